@@ -3,6 +3,7 @@
 
 #include <Arduino.h>
 #include <Wire.h>
+#include <hardware/gpio.h>
 #include <elapsedMillis.h>
 
 #include "music.h"
@@ -12,34 +13,122 @@ namespace bassboard {
 enum Register : uint8_t {
   DirectionA = 0x00, // IO direction. Set to 1 for read (is default).
   DirectionB = 0x01,
+  Config = 0x0A, // IOCON
   PullupA = 0x0C, // Set bit to 1 to enable pullup for a pin.
   PullupB = 0x0D,
   PortA = 0x12, // When read, returns the value of the pins.
   PortB = 0x13
 };
 
+// IOCON bits
+const uint8_t byteMode = 0x20; // SEQOP. With BANK = 0, the address pointer toggles between A and B.
+
+// Up to eight MCP23017's can share a bus, at addresses 0x20 to 0x27.
+const int maxBoardsPerBus = 8;
+const int firstAddress = 0x20;
+
+// An i2c controller and the pins it uses.
+class Bus {
+public:
+  TwoWire& wire;
+  const int sdaPin;
+  const int sclPin;
+  const uint32_t clock; // Hz. The MCP23017 supports up to 1 MHz (Fast-mode Plus).
+  uint32_t recoveries = 0;
+
+  Bus(TwoWire& i2c, int sda, int scl, uint32_t clockHz) :
+    wire(i2c), sdaPin(sda), sclPin(scl), clock(clockHz) {}
+
+  void begin(int timeoutMillis) {
+    wire.setSDA(sdaPin);
+    wire.setSCL(sclPin);
+    wire.setClock(clock);
+    wire.setTimeout(timeoutMillis);
+    wire.begin();
+  }
+
+  // Returns true if a device is holding SDA low while the bus should be idle.
+  // Cheap enough to check before every read, so that a stuck bus fails at once
+  // instead of waiting for the timeout.
+  bool __not_in_flash_func(stuck)() {
+    return !gpio_get(sdaPin);
+  }
+
+  // Frees the bus from a device that's stuck partway through a transfer, by clocking SCL
+  // until it lets go of SDA and then sending a stop. Takes about 100 microseconds.
+  // Returns true if SDA was released.
+  bool recover() {
+    recoveries++;
+    wire.end();
+    pinMode(sdaPin, INPUT_PULLUP);
+    pinMode(sclPin, INPUT_PULLUP);
+    for (int i = 0; i < 9 && digitalRead(sdaPin) == LOW; i++) {
+      pinMode(sclPin, OUTPUT);
+      digitalWrite(sclPin, LOW);
+      delayMicroseconds(5);
+      pinMode(sclPin, INPUT_PULLUP);
+      delayMicroseconds(5);
+    }
+    // stop condition: SDA goes high while SCL is high
+    pinMode(sdaPin, OUTPUT);
+    digitalWrite(sdaPin, LOW);
+    delayMicroseconds(5);
+    pinMode(sdaPin, INPUT_PULLUP);
+    delayMicroseconds(5);
+    bool freed = digitalRead(sdaPin) == HIGH;
+    wire.begin();
+    return freed;
+  }
+};
+
 // Communicates with a MPC23017 I/O extender over i2c.
 class Device {
 public:
-  Device(TwoWire& i2cBus, int i2caddr) : bus(i2cBus), addr(i2caddr) {}
+  Device(TwoWire& i2cBus, int i2caddr) : addr(i2caddr), bus(i2cBus) {}
 
-  // Configures the device. Returns true if successful.
-  bool begin() {
-    bus.begin();
-    if (!ping()) {
-      return false;
-    }
+  // Setting up takes this many steps of one transfer each, so that reconnecting
+  // can spread them over several frames.
+  static const int setupSteps = 4;
 
-    if (!writeTwoRegisters(DirectionA, 0xff, 0xff)) {
-      Serial.println("Couldn't set direction registers");
-      return false;
-    }
+  // Does one step of configuring the device. Returns true if successful.
+  bool setUp(int step) {
+    switch (step) {
+      case 0:
+        pointerSet = false;
+        return ping();
 
-    if (!writeTwoRegisters(PullupA, 0xff, 0xff)) {
-      Serial.println("Couldn't set pullup registers");
-      return false;
+      case 1:
+        if (!writeTwoRegisters(DirectionA, 0xff, 0xff)) {
+          Serial.println("Couldn't set direction registers");
+          return false;
+        }
+        return true;
+
+      case 2:
+        if (!writeTwoRegisters(PullupA, 0xff, 0xff)) {
+          Serial.println("Couldn't set pullup registers");
+          return false;
+        }
+        return true;
+
+      default:
+        // In byte mode, reading both ports leaves the address pointer at PortA again,
+        // so later reads don't need to set it first.
+        if (!writeRegister(Config, byteMode)) {
+          Serial.println("Couldn't set config register");
+          return false;
+        }
+        return true;
     }
+  }
 
+  // Configures the device. Returns true if successful.
+  bool begin() {
+    for (int step = 0; step < setupSteps; step++) {
+      if (!setUp(step)) {
+        return false;
+      }
+    }
     return true;
   }
 
@@ -51,12 +140,18 @@ public:
   }
 
   // Reads the value of each pin. Returns true if successful. On error, the values won't be changed.
-  bool readAll(uint16_t* values) {
-    bus.beginTransmission(addr);
-    bus.write(PortA);
-    if (bus.endTransmission() != 0) return false;
+  bool __not_in_flash_func(readAll)(uint16_t* values) {
+    if (!pointerSet) {
+      bus.beginTransmission(addr);
+      bus.write(PortA);
+      if (bus.endTransmission() != 0) return false;
+      pointerSet = true;
+    }
 
-    if (bus.requestFrom(addr, 2) != 2) return false;
+    if (bus.requestFrom(addr, 2) != 2) {
+      pointerSet = false; // not sure where it is now
+      return false;
+    }
 
     uint8_t low = bus.read();
     uint8_t hi = bus.read();
@@ -65,6 +160,14 @@ public:
   }
 
 private:
+  // Writes one register. Returns true if successful.
+  bool writeRegister(Register reg, uint8_t val) {
+    bus.beginTransmission(addr);
+    bus.write(reg);
+    bus.write(val);
+    return bus.endTransmission() == 0;
+  }
+
   // Writes two sequential registers. Returns true if successful.
   bool writeTwoRegisters(Register reg, uint8_t val1, uint8_t val2) {
     bus.beginTransmission(addr);
@@ -76,6 +179,7 @@ private:
 
   int addr;
   TwoWire& bus;
+  bool pointerSet = false;
 };
 
 const int buttonCount = 16;
@@ -84,24 +188,163 @@ struct KeyMap {
   music::Chord toNote[buttonCount];
 };
 
+// The outputs (MIDI channels) that buttons can play on.
+const int maxOutputs = 3;
+
+// What each button on a board plays on each output, with every layer of the layout
+// already merged in, so a scan costs the same however many layers there are.
+struct Routes {
+  music::Chord notes[buttonCount][maxOutputs];
+};
+
+const Routes noRoutes = {};
+
+// Timing of reads from one board, in microseconds.
+struct ScanStats {
+  uint32_t count;
+  uint32_t errors;
+  uint64_t total;
+  uint32_t max;
+
+  void clear() {
+    count = 0;
+    errors = 0;
+    total = 0;
+    max = 0;
+  }
+
+  void printTo(Print& out) {
+    out.print("count="); out.print(count);
+    out.print(" errors="); out.print(errors);
+    out.print(" avg="); out.print(count == 0 ? 0 : (uint32_t)(total / count));
+    out.print(" max="); out.print(max);
+    out.println(" us");
+  }
+};
+
+// A button being pressed or released, after debouncing.
+struct Edge {
+  uint8_t button;
+  bool down;
+  unsigned long time; // micros() when the change was first seen
+};
+
+// Debounce timing, in microseconds.
+// Presses are reported as soon as they're seen, so note-ons are never delayed.
+// After that, the contacts are ignored for pressLockout, so that bouncing doesn't
+// cause a release. A release is reported once the button has been up for releaseDelay.
+struct Debounce {
+  unsigned long pressLockout;
+  unsigned long releaseDelay;
+};
+
+const Debounce defaultDebounce = { 10000, 5000 };
+
+// Debounced state of one button.
+class Key {
+public:
+  bool down = false;
+
+  // Updates the state from a raw reading. Returns true if it changed.
+  bool __not_in_flash_func(update)(bool rawDown, unsigned long now, const Debounce& debounce) {
+    if (!down) {
+      if (rawDown) {
+        down = true;
+        changedAt = now;
+        upSince = now;
+        seenUp = false;
+        return true;
+      }
+      return false;
+    }
+
+    if (now - changedAt < debounce.pressLockout) {
+      return false;
+    }
+    if (rawDown) {
+      seenUp = false;
+      return false;
+    }
+    if (!seenUp) {
+      seenUp = true;
+      upSince = now;
+    }
+    if (now - upSince < debounce.releaseDelay) {
+      return false;
+    }
+    down = false;
+    changedAt = upSince;
+    return true;
+  }
+
+  // When the last press or release was first seen.
+  unsigned long changeTime() { return changedAt; }
+
+private:
+  unsigned long changedAt = 0;
+  unsigned long upSince = 0;
+  bool seenUp = false;
+};
+
 struct Reading {
-  music::Chord chord;
-  music::Chord bass;
+  music::Chord notes[maxOutputs]; // by output
+  unsigned long pollTime; // micros() when the buttons were read
   long readTime;
   bool valid;
+
+  // Presses and releases seen in this reading.
+  Edge edges[buttonCount];
+  int edgeCount;
+};
+
+// Reads in a row that have to fail before a board is considered offline.
+const int maxErrors = 3;
+
+// Time between attempts to reconnect an offline board, in microseconds.
+// Doubles after each failed attempt.
+const unsigned long minBackoff = 10000;
+const unsigned long maxBackoff = 1000000;
+
+// Failures and recoveries for one board.
+struct Health {
+  uint32_t disconnects; // times the board went offline
+  uint32_t probes;      // attempts to reconnect
+  uint32_t reconnects;  // successful reconnects
+
+  void printTo(Print& out) {
+    out.print("disconnects="); out.print(disconnects);
+    out.print(" probes="); out.print(probes);
+    out.print(" reconnects="); out.println(reconnects);
+  }
 };
 
 class Board {
 public:
   const char *name;
   bool ready = false;
+  ScanStats stats;
+  Health health = {};
+
+  Board(const char *boardName, Bus& i2cBus, int i2cAddr) :
+    name(boardName), bus(i2cBus), device(i2cBus.wire, i2cAddr) {
+    stats.clear();
+  }
 
-  Board(const char *boardName, TwoWire& bus, int i2cAddr, KeyMap *chord, KeyMap *bass) :
-    name(boardName), device(bus, i2cAddr), chordMap(chord), bassMap(bass) {}
+  void setDebounce(Debounce d) {
+    debounce = d;
+  }
+
+  // Changes what the buttons play. Takes effect on the next poll.
+  void setRoutes(const Routes* r) {
+    routes = r;
+  }
 
   // Returns true if successful.
   bool begin() {
    ready = device.begin();
+   errorsInARow = 0;
+   probeStep = 0;
+   lastProbe = micros();
    return ready;
   }
 
@@ -109,36 +352,131 @@ public:
     return begin();
   }
 
-  Reading poll() {
+  // Returns true if the board is offline and it's time to try reconnecting,
+  // or a reconnect is partway done.
+  bool probeDue() {
+    return !ready && (probeStep > 0 || micros() - lastProbe >= backoff);
+  }
+
+  // Tries to reconnect an offline board. Each call does one step, so that no frame
+  // waits for the whole thing: clearing the bus if it's stuck (which takes a step of
+  // its own), then each step of setting up the device. If any step fails, the next
+  // attempt starts over after the backoff. Returns true once the board is back.
+  bool probe() {
+    if (probeStep == 0) {
+      health.probes++;
+      if (bus.stuck()) {
+        bus.recover();
+        probeStep = 1;
+        return false;
+      }
+      probeStep = 1;
+    }
+    if (!device.setUp(probeStep - 1)) {
+      probeStep = 0;
+      lastProbe = micros();
+      backoff = backoff * 2 > maxBackoff ? maxBackoff : backoff * 2;
+      return false;
+    }
+    if (probeStep < Device::setupSteps) {
+      probeStep++;
+      return false;
+    }
+    probeStep = 0;
+    ready = true;
+    errorsInARow = 0;
+    health.reconnects++;
+    backoff = minBackoff;
+    return true;
+  }
+
+  // Reads the buttons. An offline board isn't read at all; call probe() to reconnect it.
+  Reading __not_in_flash_func(poll)() {
     elapsedMicros sinceStart;
 
     Reading result;
-    result.chord = music::Chord();
-    result.bass = music::Chord();
+    for (int o = 0; o < maxOutputs; o++) {
+      result.notes[o] = music::Chord();
+    }
+    result.edgeCount = 0;
+    result.pollTime = micros();
+
+    if (!ready) {
+      result.valid = false;
+      result.readTime = 0;
+      return result;
+    }
 
     uint16_t bits = 0;
-    result.valid = device.readAll(&bits) && bits != 0; // all buttons down is probably a read error
+    result.valid = !bus.stuck() && device.readAll(&bits) &&
+      bits != 0; // all buttons down is probably a read error
     result.readTime = sinceStart;
 
-    if (result.valid) {
-      for (int i = 0; i < buttonCount; i++) {
+    stats.count++;
+    stats.total += result.readTime;
+    if ((uint32_t)result.readTime > stats.max) stats.max = result.readTime;
+    if (!result.valid) {
+      stats.errors++;
+      errorsInARow++;
+      if (errorsInARow >= maxErrors) {
+        // Give up on it for now, and don't leave notes stuck on.
+        ready = false;
+        health.disconnects++;
+        probeStep = 0;
+        backoff = minBackoff;
+        lastProbe = micros();
+        releaseAll(result);
+        return result;
+      }
+    } else {
+      errorsInARow = 0;
+    }
+
+    decode(bits, result);
+    return result;
+  }
+
+  // Updates the buttons from the bits read and looks up the notes they play.
+  // On a failed read, the buttons keep their previous state.
+  void __not_in_flash_func(decode)(uint16_t bits, Reading& result) {
+    for (int i = 0; i < buttonCount; i++) {
+      if (result.valid) {
         bool buttonDown = (bits & 1) == 0;
-        if (buttonDown) {
-          result.chord = result.chord + chordMap->toNote[i];
-          result.bass = result.bass + bassMap->toNote[i];
+        if (keys[i].update(buttonDown, result.pollTime, debounce)) {
+          result.edges[result.edgeCount++] = Edge{(uint8_t)i, keys[i].down, keys[i].changeTime()};
         }
         bits = bits >> 1;
       }
+      if (keys[i].down) {
+        for (int o = 0; o < maxOutputs; o++) {
+          result.notes[o] = result.notes[o] + routes->notes[i][o];
+        }
+      }
     }
-
-    return result;
   }
 
 private:
+  Bus& bus;
   Device device;
-  const KeyMap *chordMap;
-  const KeyMap *bassMap;
-  bool pressed[buttonCount];
+  const Routes *routes = &noRoutes;
+  Key keys[buttonCount];
+  Debounce debounce = defaultDebounce;
+
+  unsigned long lastProbe = 0;
+  unsigned long backoff = minBackoff;
+  int probeStep = 0; // next step of reconnecting; 0 when none is under way
+  int errorsInARow = 0;
+
+  // Releases any buttons that are down, as if they were let go now.
+  void releaseAll(Reading& result) {
+    unsigned long now = micros();
+    for (int i = 0; i < buttonCount; i++) {
+      if (keys[i].down) {
+        keys[i] = Key();
+        result.edges[result.edgeCount++] = Edge{(uint8_t)i, false, now};
+      }
+    }
+  }
 };
 
 } // namespace
@@ -0,0 +1,95 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <Arduino.h>
+
+#include "profile.h"
+
+// Microbenchmarks for hot functions, checked against per-function budgets.
+//
+// Each benchmark runs a function many times over a set of realistic inputs, in several
+// batches, and reports the fastest batch's average. Taking the fastest batch filters out
+// interruptions, such as the sensor loop pausing this core while it reads the ADC.
+//
+// Times are in cycles on the device and nanoseconds on the host (see profile::now).
+// The benchmarks that build on the host also run in pio test -e native_bench (test/test_bench).
+
+namespace bench {
+
+struct Budget {
+  const char* name;
+  uint32_t cycles; // per call (nanoseconds on the host)
+};
+
+#ifdef ARDUINO_ARCH_RP2040
+const int batches = 5;
+#else
+const int batches = 25; // a host has more going on to interrupt it
+#endif
+
+// Stores a result somewhere the compiler can't optimize away.
+template<class T> void keep(T val) {
+  asm volatile("" : : "g"(val) : "memory");
+}
+
+class Runner {
+public:
+  Runner(Print& output, const Budget* budgetTable, int budgetCount) :
+    out(output), budgets(budgetTable), budgetCount(budgetCount) {}
+
+  // Times calls of f(i) for i from 0 to iterations - 1.
+  template<class F> void run(const char* name, int iterations, F f) {
+    uint32_t best = UINT32_MAX;
+    for (int b = 0; b < batches; b++) {
+      uint32_t start = profile::now();
+      for (int i = 0; i < iterations; i++) {
+        f(i);
+      }
+      uint32_t perCall = (profile::now() - start) / iterations;
+      if (perCall < best) best = perCall;
+#ifdef ARDUINO_ARCH_RP2040
+      rp2040.wdt_reset(); // all the batches together can outlast the watchdog
+#endif
+    }
+
+    uint32_t budget = find(name);
+    bool ok = budget == 0 || best <= budget;
+    if (!ok) failures++;
+    count++;
+
+    out.print(ok ? "PASS " : "FAIL ");
+    out.print(name);
+    out.print(" cycles="); out.print(best);
+    if (budget == 0) {
+      out.println(" (no budget)");
+    } else {
+      out.print(" budget="); out.println(budget);
+    }
+  }
+
+  // Prints the summary line that tools/bench.py waits for, such as
+  // "bench: count=13 failures=0". Returns true if every benchmark was within budget.
+  bool finish() {
+    out.print("bench: count="); out.print(count);
+    out.print(" failures="); out.println(failures);
+    return failures == 0;
+  }
+
+private:
+  Print& out;
+  const Budget* budgets;
+  int budgetCount;
+  int count = 0;
+  int failures = 0;
+
+  uint32_t find(const char* name) {
+    for (int i = 0; i < budgetCount; i++) {
+      if (strcmp(budgets[i].name, name) == 0) return budgets[i].cycles;
+    }
+    return 0;
+  }
+};
+
+} // bench
+
+#endif // BENCH_H
@@ -0,0 +1,42 @@
+#ifndef BENCH_BUDGETS_H
+#define BENCH_BUDGETS_H
+
+#include "bench.h"
+
+// Maximum cycles per call for each benchmark, at 133 MHz.
+// A sample period is 1000 us, or 133,000 cycles, shared by everything on that core.
+// Floating point is done in software on the RP2040, so float-heavy code is the expensive part.
+//
+// When a change makes something faster, run the benchmarks (tools/bench.py, or 'x' over
+// serial) and lower its budget to a little above the new measurement, so a later
+// regression shows up. tools/bench.py also checks against the last recorded baseline,
+// and pio test -e native_bench checks most of them on the host (test/test_bench).
+
+namespace bench {
+
+const Budget budgets[] = {
+  // sensor (core 1)
+  { "approximatePhase", 200 },
+  { "calculatePhase", 250 },
+  { "countLaps", 250 },
+  { "EllipseFit::add", 4000 },
+
+  // calibration (core 0)
+  { "Weights::addRange", 4000 },
+  { "Weights::update", 20000 },
+  { "LookupTable::setWeights", 8000 },
+  { "LookupTable::adjust", 1500 },
+  { "calculateLaps", 8000 },
+
+  // buttons and output (core 0)
+  { "Board::decode", 3000 },
+  { "Chord::operator+", 100 },
+  { "Chord::countNotes", 2500 },
+  { "Channel::sendChord", 6000 },
+};
+
+const int budgetCount = sizeof(budgets) / sizeof(budgets[0]);
+
+} // bench
+
+#endif // BENCH_BUDGETS_H
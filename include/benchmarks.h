@@ -0,0 +1,95 @@
+#ifndef BENCHMARKS_H
+#define BENCHMARKS_H
+
+#include <math.h>
+
+#include "bench.h"
+#include "calibration.h"
+#include "bassboard.h"
+#include "bassmaps.h"
+#include "layout.h"
+#include "midi_out.h"
+#include "music.h"
+
+// Microbenchmarks for core 0's header-only code, shared by runBenchmarks on the device
+// and the native benchmarks (test/test_bench), so both time the same inputs.
+// Inputs and state are static, since together they'd take much of core 0's 2 KB stack.
+
+namespace bench {
+
+void runCalibration(Runner& runner) {
+  // Positions and speeds like a bellows stroke.
+  const int inputCount = 64;
+  static float positions[inputCount];
+  for (int i = 0; i < inputCount; i++) {
+    positions[i] = 0.35 * sinf(i * 2 * M_PI / inputCount) + 0.5;
+  }
+
+  static calibration::Weights w(0);
+  w.fill(0);
+  runner.run("Weights::addRange", 1000, [&](int i) {
+    float start = positions[i % inputCount];
+    float end = positions[(i + 1) % inputCount];
+    keep(w.addRange(start, end, 1));
+  });
+
+  static calibration::Weights target(0);
+  target.fill(1.0 / calibration::binCount);
+  runner.run("Weights::update", 100, [&](int i) {
+    target.update(w, 0.02);
+  });
+
+  static calibration::LookupTable table;
+  runner.run("LookupTable::setWeights", 100, [&](int i) {
+    table.setWeights(target.bin);
+  });
+
+  runner.run("LookupTable::adjust", 1000, [&](int i) {
+    keep(table.adjust(positions[i % inputCount] + (i & 3)));
+  });
+}
+
+void runButtons(Runner& runner, bassboard::Bus& bus) {
+  // A board that's never started, so decoding doesn't touch the bus.
+  static bassboard::Board board("bench", bus, bassboard::firstAddress);
+  board.setRoutes(&layout::active->routes[0]);
+  runner.run("Board::decode", 1000, [&](int i) {
+    bassboard::Reading r;
+    for (int o = 0; o < bassboard::maxOutputs; o++) {
+      r.notes[o] = music::Chord();
+    }
+    r.edgeCount = 0;
+    r.valid = true;
+    r.pollTime = i * 5000;
+    uint16_t bits = ~(1 << (i % bassboard::buttonCount)); // one button down at a time
+    board.decode(bits, r);
+    keep(r.notes[layout::chord].toBits());
+  });
+}
+
+void runOutput(Runner& runner) {
+  static music::Chord chords[bassboard::buttonCount];
+  for (int i = 0; i < bassboard::buttonCount; i++) {
+    chords[i] = bassmaps::lowerChordCustom.toNote[i] + bassmaps::upperChordCustom.toNote[i];
+  }
+
+  runner.run("Chord::operator+", 1000, [&](int i) {
+    keep((chords[i % bassboard::buttonCount] + chords[(i + 3) % bassboard::buttonCount]).toBits());
+  });
+
+  runner.run("Chord::countNotes", 1000, [&](int i) {
+    keep(chords[i % bassboard::buttonCount].countNotes());
+  });
+
+  // Sends to memory, not USB.
+  static midiOut::RecordingTransport<16> recorder;
+  static midiOut::Channel<midiOut::RecordingTransport<16>, layout::velocity<layout::chord>> channel(recorder, 1);
+  runner.run("Channel::sendChord", 1000, [&](int i) {
+    recorder.clear();
+    keep(channel.sendChord(chords[i % bassboard::buttonCount]));
+  });
+}
+
+} // bench
+
+#endif // BENCHMARKS_H
@@ -0,0 +1,90 @@
+#ifndef BOOT_H
+#define BOOT_H
+
+#include <Arduino.h>
+
+// Timestamps of each step from power-on to the first MIDI output.
+// micros() starts at reset, so each time is also the time since power-on.
+// The USB phases start over whenever the host enumerates the device again.
+
+namespace boot {
+
+enum Phase {
+  UsbStarted,    // MIDI device registered; the host can start enumerating
+  SensorPowered, // core 1 can start its warmup
+  BoardsStarted, // first attempt to reach each button board
+  SetupDone,
+  SensorWarm,    // sensor readings settled (timed on core 1)
+  FirstReport,   // first report from core 1
+  UsbMounted,    // host has configured the device
+  FirstControl,  // first bellows control change sent to a mounted host
+  FirstNote,     // first note sent to a mounted host (needs a button press)
+  phaseCount
+};
+
+const char* const phaseNames[phaseCount] = {
+  "usbStarted", "sensorPowered", "boardsStarted", "setupDone", "sensorWarm",
+  "firstReport", "usbMounted", "firstControl", "firstNote"
+};
+
+// Power-on to first bellows control change. Most of this is usually the host enumerating.
+// Checked on the first enumeration only; after that, only mount to first MIDI is shown.
+const unsigned long firstMidiTarget = 500000; // microseconds
+
+unsigned long at[phaseCount];
+bool reached[phaseCount];
+uint32_t enumerations = 0;
+
+void mark(Phase p, unsigned long time) {
+  if (!reached[p]) {
+    at[p] = time;
+    reached[p] = true;
+  }
+}
+
+void mark(Phase p) {
+  mark(p, micros());
+}
+
+// Call every frame. Returns true if the host has just mounted the device.
+bool checkUsb(bool mounted) {
+  static bool wasMounted = false;
+  bool newlyMounted = mounted && !wasMounted;
+  wasMounted = mounted;
+  if (newlyMounted) {
+    enumerations++;
+    reached[UsbMounted] = false;
+    reached[FirstControl] = false;
+    reached[FirstNote] = false;
+    mark(UsbMounted);
+  }
+  return newlyMounted;
+}
+
+void printTo(Print& out) {
+  for (int i = 0; i < phaseCount; i++) {
+    out.print(phaseNames[i]); out.print("=");
+    if (reached[i]) {
+      out.print(at[i]); out.print(" us");
+    } else {
+      out.print("-");
+    }
+    out.print(i == phaseCount - 1 ? "\n" : " ");
+  }
+  out.print("enumerations="); out.print(enumerations);
+  if (reached[FirstControl]) {
+    // Only the first enumeration follows power-on, so later ones can't meet the target.
+    if (enumerations == 1) {
+      out.print(" firstMidi="); out.print(at[FirstControl]);
+      out.print(" us (target "); out.print(firstMidiTarget);
+      out.print(at[FirstControl] <= firstMidiTarget ? ", ok)" : ", late)");
+    }
+    out.print(" afterMount="); out.print(at[FirstControl] - at[UsbMounted]);
+    out.print(" us");
+  }
+  out.println();
+}
+
+} // boot
+
+#endif // BOOT_H
@@ -0,0 +1,53 @@
+#ifndef BUSPERF_H
+#define BUSPERF_H
+
+#include <Arduino.h>
+#include <hardware/structs/busctrl.h>
+#include <hardware/structs/xip_ctrl.h>
+
+// Counts XIP cache misses and bus contention using the RP2040's hardware counters.
+// Nothing is added to the hot path; the counters run in hardware until read.
+
+namespace busperf {
+
+const int counterCount = 4;
+
+const char* const counterNames[counterCount] = {
+  "xipContested",
+  "scratchXContested",
+  "scratchYContested",
+  "sram0Contested",
+};
+
+void begin() {
+  bus_ctrl_hw->counter[0].sel = arbiter_xip_main_perf_event_access_contested;
+  bus_ctrl_hw->counter[1].sel = arbiter_sram4_perf_event_access_contested;
+  bus_ctrl_hw->counter[2].sel = arbiter_sram5_perf_event_access_contested;
+  bus_ctrl_hw->counter[3].sel = arbiter_sram0_perf_event_access_contested;
+  for (int i = 0; i < counterCount; i++) {
+    bus_ctrl_hw->counter[i].value = 0; // any write clears
+  }
+  xip_ctrl_hw->ctr_hit = 0;
+  xip_ctrl_hw->ctr_acc = 0;
+}
+
+// Prints the counts since the last call, then clears them.
+void printTo(Print& out) {
+  uint32_t hits = xip_ctrl_hw->ctr_hit;
+  uint32_t accesses = xip_ctrl_hw->ctr_acc;
+  xip_ctrl_hw->ctr_hit = 0;
+  xip_ctrl_hw->ctr_acc = 0;
+
+  out.print("xipAccesses="); out.print(accesses);
+  out.print(" xipMisses="); out.print(accesses - hits);
+  for (int i = 0; i < counterCount; i++) {
+    uint32_t val = bus_ctrl_hw->counter[i].value;
+    bus_ctrl_hw->counter[i].value = 0;
+    out.print(" "); out.print(counterNames[i]); out.print("="); out.print(val);
+  }
+  out.println();
+}
+
+} // busperf
+
+#endif // BUSPERF_H
@@ -3,11 +3,30 @@
 
 #include <math.h>
 
+#include "profile.h"
+
 namespace calibration {
 
 const int binCount = 72;
 const int minSamples = 8;
 
+// Reports can vary in length (see sensor::Rate). Limits given per report are for reports
+// this long, and scaled for others, so that they stay the same speed.
+const int referenceDuration = 5000; // microseconds
+
+enum Mode {
+  // Learns only from complete laps in one direction.
+  fullLaps,
+  // Learns from every report, including partial strokes in either direction.
+  dwellTime,
+};
+
+// dwellTime, from the comparison in test/test_calibration: it calibrates wherever fullLaps
+// does, sooner and more accurately, and also on partial strokes, where fullLaps never
+// calibrates and the bellows stays silent. Its weak spot is strokes that always slow
+// down near the same turning points, which it mistakes for distortion.
+Mode mode = dwellTime;
+
 class Weights {
 public:
   float bin[binCount];
@@ -57,7 +76,7 @@ public:
       return end - start;
     }
     float valPerBin = val/(end - start);
-    add(startbin, valPerBin * (ceil(start) - start));
+    add(startbin, valPerBin * (startbin + 1 - start));
     add(endbin, valPerBin * (end - floor(end)));
     for (int i = startbin + 1; i < endbin; i++) {
       add(i, valPerBin);
@@ -112,7 +131,9 @@ int weightUpdateCount = 0;
 int nextBin = 0;
 bool foundLap = false;
 
-void __not_in_flash_func(updateWeights)(float laps) {
+const float minRange = 0.5; // bins per report; slower motion isn't used (scaled)
+
+void __not_in_flash_func(updateWeights)(float laps, int duration) {
   if (foundLap) {
     if (partial.total >= minSamples) {
       weights.update(partial, 0.02);
@@ -149,7 +170,7 @@ void __not_in_flash_func(updateWeights)(float laps) {
     }
   }
   float rangeChanged = partial.addRange(prevPos, laps, 1);
-  if (rangeChanged < 0.5) {
+  if (rangeChanged < minRange * duration / referenceDuration) {
     // too slow
     lapDirection = none;
     return;
@@ -157,17 +178,140 @@ void __not_in_flash_func(updateWeights)(float laps) {
   prevPos = laps;
 }
 
+// Dwell-time calibration.
+//
+// Each stroke in one direction is split into segments. Assuming the bellows moves at a
+// roughly steady speed during a segment, every report in it (they're all the same length)
+// covers the same true angle:
+// the segment's length (measured with the current lookup table) divided by the number
+// of reports. Spreading that angle across the bins each report crossed gives the
+// true width of each bin. This works for partial strokes in either direction, so short
+// back-and-forth playing still calibrates.
+//
+// Each bin starts out learning quickly (a plain average) and then settles into a
+// moving average once it has been crossed maxCoverage times.
+
+const int maxSegmentTime = 320000;  // microseconds; longer segments are split
+const float minSegmentLength = 0.1; // laps; shorter segments are ignored
+const float minSpeed = 0.002;       // laps per report; slower than this ends a segment (scaled)
+const float maxSpeedChange = 0.5;   // fraction of a report's movement it can differ from the last
+const float maxCoverage = 20;       // bin crossings remembered per bin
+const float targetCoverage = 3;     // bin crossings needed for full confidence
+const float priorCoverage = 1;      // weight of the uniform prior, in bin crossings
+
+Weights dwellAngle(0);    // estimated true angle seen in each bin, in laps
+Weights dwellCoverage(0); // number of times each bin was crossed
+Weights segmentDwell(0);  // reports spent in each bin since the segment started
+float segmentStart;
+float segmentEnd;        // position at the last report
+float segmentDelta;      // movement in the last report
+int segmentReports = -1; // -1 until the first report
+LapDirection segmentDirection = none;
+int segmentDuration = 0; // microseconds per report
+bool dwellChanged = false;
+float dwellConfidence = 0;
+
+void __not_in_flash_func(finishSegment)() {
+  if (segmentReports > 0 && fabs(segmentEnd - segmentStart) >= minSegmentLength) {
+    float angle = fabs(lookupTable.adjust(segmentEnd) - lookupTable.adjust(segmentStart)) / segmentReports;
+    for (int i = 0; i < binCount; i++) {
+      dwellAngle.bin[i] += segmentDwell.bin[i] * angle;
+    }
+    dwellAngle.total += segmentDwell.total * angle;
+    dwellCoverage.addRange(segmentStart, segmentEnd, fabs(segmentEnd - segmentStart) * binCount);
+    dwellChanged = true;
+  }
+  segmentDwell.fill(0);
+  segmentStart = segmentEnd;
+  segmentReports = 0;
+}
+
+void __not_in_flash_func(updateDwell)(float laps, int duration) {
+  if (segmentReports < 0) {
+    segmentStart = segmentEnd = laps;
+    segmentReports = 0;
+    segmentDuration = duration;
+    return;
+  }
+  float delta = laps - segmentEnd;
+  LapDirection dir = delta < 0 ? down : (delta > 0) ? up : none;
+  float prevDelta = segmentReports > 0 ? segmentDelta : delta;
+  if (dir != segmentDirection || duration != segmentDuration ||
+      fabs(delta) < minSpeed * duration / referenceDuration || fabs(delta) > 0.5 ||
+      fabs(delta - prevDelta) > maxSpeedChange * fabs(delta)) {
+    // The speed isn't steady (or reports changed length), so start over from here.
+    finishSegment();
+    segmentStart = segmentEnd = laps;
+    segmentDirection = dir;
+    segmentDuration = duration;
+    return;
+  }
+  segmentDwell.addRange(segmentEnd, laps, 1);
+  segmentEnd = laps;
+  segmentDelta = delta;
+  segmentReports++;
+  if (segmentReports * duration >= maxSegmentTime) {
+    finishSegment();
+  }
+}
+
+// Recalculates the weights from the dwell totals.
+void __not_in_flash_func(rebuildFromDwell)() {
+  float prior = 1.0 / binCount;
+  float sum = 0;
+  for (int i = 0; i < binCount; i++) {
+    float coverage = dwellCoverage.bin[i];
+    if (coverage > maxCoverage) {
+      float scale = maxCoverage / coverage;
+      dwellAngle.bin[i] *= scale;
+      dwellCoverage.bin[i] *= scale;
+    }
+    float width = (dwellAngle.bin[i] + prior * priorCoverage) / (dwellCoverage.bin[i] + priorCoverage);
+    weights.bin[i] = width;
+    sum += width;
+  }
+  float confidenceSum = 0;
+  for (int i = 0; i < binCount; i++) {
+    weights.bin[i] /= sum;
+    float c = dwellCoverage.bin[i] / targetCoverage;
+    confidenceSum += c > 1 ? 1 : c;
+  }
+  weights.total = 1;
+  dwellConfidence = confidenceSum / binCount;
+  weightUpdateCount++;
+}
+
+// Returns a number from 0 to 1 indicating how well each bin has been measured.
+float confidence() {
+  if (mode == fullLaps) {
+    return weightUpdateCount >= 5 ? 1 : weightUpdateCount / 5.0;
+  }
+  return dwellConfidence;
+}
+
 struct WeightMetrics {
   int updateCount;
+  float confidence;
   int bin;
   float binWeight;
   float binAdjustment;
 };
 
-WeightMetrics __not_in_flash_func(adjustWeights)(float laps) {
-  updateWeights(laps);
+// Call once per report. Duration is the report's length in microseconds.
+WeightMetrics __not_in_flash_func(adjustWeights)(float laps, int duration) {
+  PROFILE_SECTION(AdjustWeights);
+  if (mode == fullLaps) {
+    updateWeights(laps, duration);
+  } else {
+    updateDwell(laps, duration);
+    if (nextBin == 0 && dwellChanged) {
+      rebuildFromDwell();
+      dwellChanged = false;
+    }
+  }
   WeightMetrics result;
   result.updateCount = weightUpdateCount;
+  result.confidence = confidence();
   result.bin = nextBin;
   result.binWeight = weights.get(nextBin);
   result.binAdjustment = lookupTable.bin[nextBin];
@@ -178,6 +322,7 @@ WeightMetrics __not_in_flash_func(adjustWeights)(float laps) {
 int seenWeightUpdates = 0;
 
 float __not_in_flash_func(adjustLaps)(float laps) {
+  PROFILE_SECTION(AdjustLaps);
   if (seenWeightUpdates < weightUpdateCount) {
       lookupTable.setWeights(weights.bin);
       seenWeightUpdates = weightUpdateCount;
@@ -186,7 +331,10 @@ float __not_in_flash_func(adjustLaps)(float laps) {
 }
 
 bool calibrated() {
-  return seenWeightUpdates >= 5;
+  if (mode == fullLaps) {
+    return seenWeightUpdates >= 5;
+  }
+  return seenWeightUpdates > 0 && confidence() >= 0.9;
 }
 
 } // calibration
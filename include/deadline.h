@@ -0,0 +1,97 @@
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#include <Arduino.h>
+#include "latency.h"
+
+// Checks that each pass through loop() finishes before the next sensor report is due.
+// A frame starts when a report arrives and ends when loop() asks for the next one, so
+// its deadline is the report's duration. While core 0 is late, core 1 waits to hand
+// over its report instead of sampling, so an overrun delays the bellows too.
+//
+// Time in a frame is charged to a cause. When a frame overruns, the overrun is blamed
+// on whichever cause took the longest in that frame.
+
+namespace deadline {
+
+enum Cause {
+  Midi,        // reading MIDI input and sending output
+  Calibration, // calculating laps and adjusting weights
+  Poll,        // reading the button boards over i2c
+  Logging,     // serial output and commands
+  causeCount
+};
+
+// Overruns in microseconds, by cause.
+latency::Histogram overruns[causeCount] = {
+  latency::Histogram("midi overrun"),
+  latency::Histogram("calibration overrun"),
+  latency::Histogram("poll overrun"),
+  latency::Histogram("logging overrun"),
+};
+
+uint32_t frames = 0;
+uint32_t maxFrame = 0; // microseconds
+
+uint32_t spent[causeCount]; // in the current frame
+unsigned long frameStart;
+int frameBudget = 0; // 0 when no frame is open
+
+void __not_in_flash_func(startFrame)(int budget) {
+  frameStart = micros();
+  frameBudget = budget;
+  for (int i = 0; i < causeCount; i++) {
+    spent[i] = 0;
+  }
+}
+
+void __not_in_flash_func(endFrame)() {
+  if (frameBudget == 0) {
+    return;
+  }
+  uint32_t elapsed = micros() - frameStart;
+  frames++;
+  if (elapsed > maxFrame) maxFrame = elapsed;
+  if (elapsed > (uint32_t)frameBudget) {
+    int worst = 0;
+    for (int i = 1; i < causeCount; i++) {
+      if (spent[i] > spent[worst]) worst = i;
+    }
+    overruns[worst].add(elapsed - frameBudget);
+  }
+  frameBudget = 0;
+}
+
+// Charges the time until it goes out of scope to a cause.
+class Timer {
+public:
+  Timer(Cause c) : cause(c), start(micros()) {}
+  ~Timer() {
+    spent[cause] += micros() - start;
+  }
+
+private:
+  Cause cause;
+  unsigned long start;
+};
+
+void printTo(Print& out) {
+  out.print("frames="); out.print(frames);
+  out.print(" maxFrame="); out.print(maxFrame);
+  out.println(" us");
+  for (int i = 0; i < causeCount; i++) {
+    overruns[i].printTo(out);
+  }
+}
+
+void clear() {
+  frames = 0;
+  maxFrame = 0;
+  for (int i = 0; i < causeCount; i++) {
+    overruns[i].clear();
+  }
+}
+
+} // deadline
+
+#endif // DEADLINE_H
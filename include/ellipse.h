@@ -0,0 +1,163 @@
+#ifndef ELLIPSE_H
+#define ELLIPSE_H
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "placement.h"
+#include "sensor.h"
+
+namespace sensor {
+
+// Used until the fit has seen enough motion.
+const int defaultCentre = 300;
+
+// Corrected samples are scaled to this radius.
+const int unitRadius = 256;
+
+// Tracks the highest and lowest values of one sensor channel.
+// The peaks move inward a little as the magnet moves, so that they follow drift,
+// but they stay put when the bellows is at rest.
+class Envelope {
+public:
+  float low = NAN;
+  float high = NAN;
+
+  void CORE1_FUNC(add)(int val, int change) {
+    if (isnan(low)) {
+      low = val;
+      high = val;
+      return;
+    }
+    int motion = abs(change);
+    if (motion >= noiseLevel) {
+      float shrink = motion * shrinkRate;
+      high -= shrink;
+      low += shrink;
+    }
+    if (val > high) high = val;
+    if (val < low) low = val;
+  }
+
+  float centre() { return (high + low) / 2; }
+  float radius() { return (high - low) / 2; }
+
+private:
+  static const int noiseLevel = 3;
+  static constexpr float shrinkRate = 0.002;
+};
+
+// Fits the ellipse traced by the A and B sensor readings as the magnet turns.
+// Corrects for offset and gain on each channel and for the two channels not being
+// exactly 90 degrees apart, so that corrected samples lie on a circle.
+//
+// The skew is measured at the peaks of A, where B = sin(skew angle) for an ideal sensor.
+//
+// The fit is only used once each channel has reached both its real extremes, which
+// takes at least three quarters of a turn. A channel at the edge of its envelope only
+// counts as a real peak if the other channel is away from its own edges at the time.
+// Otherwise it's probably where a partial stroke turned around, which puts both
+// channels at their edges at once.
+class EllipseFit {
+public:
+  void CORE1_FUNC(add)(int a, int b) {
+    a_.add(a, a - prevA);
+    b_.add(b, b - prevB);
+    prevA = a;
+    prevB = b;
+
+    if (a_.radius() < minRadius || b_.radius() < minRadius) {
+      return;
+    }
+
+    float x = (a - a_.centre()) / a_.radius();
+    float y = (b - b_.centre()) / b_.radius();
+    if (trackPeak(x, y, aPeak) && peakCount < minPeaks) peakCount++;
+    trackPeak(y, x, bPeak);
+    if (!aPeak.inPeak || fabsf(x) < peakLevel) {
+      return;
+    }
+    float estimate = (x > 0) ? y : -y;
+    if (estimate > maxSkew) estimate = maxSkew;
+    if (estimate < -maxSkew) estimate = -maxSkew;
+    skew += (estimate - skew) * skewRate;
+    skewScale = 1 / sqrtf(1 - skew * skew);
+  }
+
+  bool fitted() {
+    return aPeak.sides == bothSides && bPeak.sides == bothSides && peakCount >= minPeaks;
+  }
+
+  // Converts a sample into coordinates centered on zero.
+  void CORE1_FUNC(correct)(int a, int b, int& x, int& y) {
+    if (!fitted()) {
+      x = a - defaultCentre;
+      y = b - defaultCentre;
+      return;
+    }
+    float nx = (a - a_.centre()) / a_.radius();
+    float ny = (b - b_.centre()) / b_.radius();
+    ny = (ny - nx * skew) * skewScale;
+    x = nx * unitRadius;
+    y = ny * unitRadius;
+  }
+
+  Ellipse params() {
+    Ellipse result;
+    result.centreA = a_.centre();
+    result.centreB = b_.centre();
+    result.radiusA = a_.radius();
+    result.radiusB = b_.radius();
+    result.skew = skew;
+    result.fitted = fitted();
+    return result;
+  }
+
+private:
+  // Peaks seen on one channel.
+  struct Peaks {
+    bool inPeak = false;
+    uint8_t sides = 0; // highSide and lowSide bits, for each extreme reached
+  };
+
+  static const uint8_t highSide = 1;
+  static const uint8_t lowSide = 2;
+  static const uint8_t bothSides = highSide | lowSide;
+
+  // Updates the peaks for a channel at v, when the other one is at other (both scaled
+  // to the envelope). Returns true on reaching a new real peak.
+  static bool CORE1_FUNC(trackPeak)(float v, float other, Peaks& p) {
+    if (p.inPeak) {
+      if (fabsf(v) < leaveLevel) p.inPeak = false;
+      return false;
+    }
+    if (fabsf(v) < peakLevel || fabsf(other) > otherLevel) {
+      return false;
+    }
+    p.inPeak = true;
+    p.sides |= (v > 0) ? highSide : lowSide;
+    return true;
+  }
+
+  static const int minRadius = 30;
+  static const int minPeaks = 4;    // distinct peaks of A (two turns)
+  static constexpr float peakLevel = 0.99;
+  static constexpr float leaveLevel = 0.8; // a peak ends once the channel falls back below this
+  static constexpr float otherLevel = 0.7; // the other channel must be nearer its centre than this
+  static constexpr float maxSkew = 0.5;
+  static constexpr float skewRate = 0.05;
+
+  Envelope a_;
+  Envelope b_;
+  int prevA = 0;
+  int prevB = 0;
+  float skew = 0; // sine of the phase error between channels
+  float skewScale = 1;
+  Peaks aPeak;
+  Peaks bPeak;
+  int peakCount = 0;
+};
+
+} // sensor
+
+#endif // ELLIPSE_H
@@ -0,0 +1,166 @@
+#ifndef LAPS_H
+#define LAPS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "placement.h"
+#include "profile.h"
+#include "sensor.h"
+
+namespace sensor {
+
+// Lap counting only sees the phase, so a change of more than half a turn between samples
+// is ambiguous. To resolve it, the counter tracks the angular velocity and unwraps the
+// phase around where it predicts the magnet to be, rather than where it was.
+// This works at any steady speed, provided the speed changes by less than maxSurprise
+// between samples. It also copes with late samples, since the prediction uses the
+// actual time between them.
+
+// Velocity is in ticks per microsecond, fixed point with 16 fraction bits.
+const int velocityShift = 16;
+
+// Far faster than anyone can pump, at 50 turns per second. Keeps the arithmetic in range.
+const int maxVelocity = ((int64_t)ticksPerTurn * 50 << velocityShift) / 1000000;
+
+// Longer gaps than this are predicted as if they were this long.
+// (A stall this long loses track anyway, and it keeps the prediction in range.)
+const int maxPredictTime = 100000;
+
+// A sample this far from the prediction can't be real motion, since the bellows can't
+// speed up that much in one sample. It's treated as a glitch: counted, but otherwise
+// ignored, and the counter keeps predicting from the last sample it trusted.
+const int maxSurprise = quarterTurn;
+
+// If this many jumps in a row follow on from each other at a steady speed, they aren't
+// glitches; the velocity is what's wrong, as when the bellows starts faster than
+// maxSurprise per sample. Tracking carries on from the latest one at the jumps' speed,
+// and the laps they crossed are counted.
+const int jumpsToResync = 3;
+
+struct LapCounter {
+  int laps = 0;
+  int prevTheta = 0;          // last trusted sample
+  unsigned long prevTime = 0;
+  int velocity = 0;
+  int jumps = 0;              // samples too far from the prediction
+  int jumpsInARow = 0;        // that follow on from each other
+  int jumpTheta = 0;          // latest jump
+  unsigned long jumpTime = 0;
+  int jumpVelocity = 0;       // as if the jumps were real motion
+  int jumpTravel = 0;         // ticks from the last trusted sample to the latest jump
+};
+
+// Wraps a change in phase to within half a turn either way.
+static int CORE1_FUNC(wrapChange)(int change) {
+  change %= ticksPerTurn;
+  if (change < -halfTurn) {
+    change += ticksPerTurn;
+  } else if (change >= halfTurn) {
+    change -= ticksPerTurn;
+  }
+  return change;
+}
+
+static int CORE1_FUNC(clampTime)(int dt) {
+  if (dt <= 0) return 1;
+  if (dt > maxPredictTime) return maxPredictTime;
+  return dt;
+}
+
+// Returns how far the magnet turns in dt microseconds at velocity.
+static int CORE1_FUNC(predictChange)(int velocity, int dt) {
+  return (velocity * clampTime(dt)) >> velocityShift;
+}
+
+static int CORE1_FUNC(velocityOf)(int change, int dt) {
+  int v = (change << velocityShift) / clampTime(dt);
+  if (v > maxVelocity) return maxVelocity;
+  if (v < -maxVelocity) return -maxVelocity;
+  return v;
+}
+
+// Rounds down to whole laps.
+static int CORE1_FUNC(lapsIn)(int ticks) {
+  return ticks >= 0 ? ticks / ticksPerTurn : -((ticksPerTurn - 1 - ticks) / ticksPerTurn);
+}
+
+// Counts a sample that isn't where the magnet should be, as if it were real motion of
+// change ticks in dt. Returns true once enough jumps have followed on from each other to
+// trust them instead.
+static bool CORE1_FUNC(countJump)(LapCounter& lc, const Reading& r, bool follows, int change, int dt) {
+  lc.jumps++;
+  lc.jumpVelocity = velocityOf(change, dt);
+  if (follows) {
+    lc.jumpTravel += change;
+    lc.jumpsInARow++;
+  } else {
+    lc.jumpTravel = change;
+    lc.jumpsInARow = 1;
+  }
+  lc.jumpTheta = r.theta;
+  lc.jumpTime = r.sampleTime;
+  return lc.jumpsInARow >= jumpsToResync;
+}
+
+static void CORE1_FUNC(countLaps)(LapCounter& lc, Report &rep) {
+  PROFILE_SECTION(CountLaps);
+  int dt = rep.last.sampleTime - lc.prevTime;
+  int predictedChange = predictChange(lc.velocity, dt);
+
+  // Unwrap the difference from the prediction to within half a turn.
+  int surprise = wrapChange(rep.last.theta - lc.prevTheta - predictedChange);
+  bool trusted = abs(surprise) <= maxSurprise;
+
+  // After a jump, the sample might instead follow on from it. If it fits both, it's taken
+  // as following on if it's closer to that, or if two jumps already have, since then it's
+  // the glitches that would be the coincidence.
+  bool follows = false;
+  int jumpDt = rep.last.sampleTime - lc.jumpTime;
+  int jumpChange = 0;
+  if (lc.jumpsInARow > 0) {
+    int jumpPredicted = predictChange(lc.jumpVelocity, jumpDt);
+    int jumpSurprise = wrapChange(rep.last.theta - lc.jumpTheta - jumpPredicted);
+    jumpChange = jumpPredicted + jumpSurprise;
+    follows = abs(jumpSurprise) <= maxSurprise &&
+        (!trusted || lc.jumpsInARow > 1 || abs(jumpSurprise) < abs(surprise));
+  }
+
+  int thetaChange = predictedChange + surprise;
+  if (follows || !trusted) {
+    bool resync = follows ? countJump(lc, rep.last, true, jumpChange, jumpDt) :
+        countJump(lc, rep.last, false, thetaChange, dt);
+    if (!resync) {
+      // Report where the magnet should be instead, without moving the lap count.
+      int unwrapped = lc.prevTheta + predictedChange;
+      int laps = lapsIn(unwrapped);
+      rep.last.laps = lc.laps + laps;
+      rep.last.theta = unwrapped - laps * ticksPerTurn;
+      rep.jumps = lc.jumps;
+      return;
+    }
+    thetaChange = lc.jumpTravel;
+    lc.velocity = lc.jumpVelocity;
+  } else {
+    lc.velocity += (velocityOf(thetaChange, dt) - lc.velocity) >> 1;
+  }
+  lc.jumpsInARow = 0;
+
+  // Count whole laps crossed, from where the phase was to where it is now.
+  lc.laps += lapsIn(lc.prevTheta + thetaChange);
+
+  rep.last.laps = lc.laps;
+  lc.prevTheta = rep.last.theta;
+  lc.prevTime = rep.last.sampleTime;
+  rep.thetaChange += thetaChange;
+  rep.speed = ((int64_t)lc.velocity * 1000000) >> velocityShift;
+  rep.jumps = lc.jumps;
+}
+
+int maxSafeSpeed(int samplePeriod) {
+  return (int64_t)maxSurprise * 1000000 / samplePeriod;
+}
+
+} // sensor
+
+#endif // LAPS_H
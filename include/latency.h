@@ -0,0 +1,68 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <Arduino.h>
+
+namespace latency {
+
+// Bucket 0 counts zeros. Bucket i counts values from 2^(i-1) to 2^i - 1 microseconds.
+// The last bucket also counts anything larger.
+const int bucketCount = 24;
+
+// Counts durations using logarithmic buckets, so that adding a value is cheap
+// and percentiles can be estimated later without keeping every sample.
+class Histogram {
+public:
+  const char* name;
+  uint32_t bucket[bucketCount];
+  uint32_t count;
+  uint32_t max;
+
+  Histogram(const char* histName) : name(histName) {
+    clear();
+  }
+
+  void clear() {
+    for (int i = 0; i < bucketCount; i++) {
+      bucket[i] = 0;
+    }
+    count = 0;
+    max = 0;
+  }
+
+  void __not_in_flash_func(add)(uint32_t micros) {
+    int i = (micros == 0) ? 0 : 32 - __builtin_clz(micros);
+    if (i >= bucketCount) i = bucketCount - 1;
+    bucket[i]++;
+    count++;
+    if (micros > max) max = micros;
+  }
+
+  // Returns an upper bound for the given percentile (0 to 100), or 0 if empty.
+  uint32_t percentile(int pct) {
+    uint32_t target = (count * pct + 99) / 100;
+    if (target == 0) target = 1;
+    uint32_t seen = 0;
+    for (int i = 0; i < bucketCount; i++) {
+      seen += bucket[i];
+      if (seen >= target) {
+        uint32_t upper = (1UL << i) - 1;
+        return upper < max ? upper : max;
+      }
+    }
+    return max;
+  }
+
+  void printTo(Print& out) {
+    out.print(name);
+    out.print(": count="); out.print(count);
+    out.print(" p50="); out.print(percentile(50));
+    out.print(" p99="); out.print(percentile(99));
+    out.print(" max="); out.print(max);
+    out.println(" us");
+  }
+};
+
+} // latency
+
+#endif // LATENCY_H
@@ -0,0 +1,358 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <Arduino.h>
+#include <MIDI.h>
+#include <string.h>
+
+#include "music.h"
+#include "bassboard.h"
+
+// Key maps, velocities and channels that can be changed at runtime over SysEx.
+//
+// Each board has any number of layers. A layer is a key map that plays on one output, with
+// its own velocity, so octave doublings and splits are just more layers. When a layout is
+// committed, its layers are compiled into flat tables: what each button plays on each
+// output, and the velocity of each note on each output. Reading the buttons only uses
+// those, so it doesn't get slower as layers are added.
+//
+// There are two copies of the layout. The buttons are always read using the active one,
+// while SysEx messages edit the other. A commit message swaps them, but the swap is only
+// done between frames, so a scan never sees a half-edited layout.
+//
+// Messages (all values are 7-bit bytes):
+//
+//   F0 7D 01 board layer key c0..c9 F7   Sets what a button plays in one of the board's layers.
+//                                        c0..c9 hold the 64-bit Chord, 7 bits each, lowest first.
+//   F0 7D 02 note F7                     Sets the bottom bass note and resets the bass velocities.
+//   F0 7D 03 output start v0..vn F7      Sets velocities for notes ChordBase + start onward.
+//                                        Outputs are 0 (treble), 1 (chord) and 2 (bass).
+//   F0 7D 04 output channel F7           Sets an output's MIDI channel (1 to 16).
+//   F0 7D 05 board layer output pct F7   Sets where a layer plays, and its velocity as a percent
+//                                        (1 to 127) of the output's. Using the board's layer
+//                                        count as the layer adds a new, empty layer.
+//   F0 7D 06 board count F7              Removes all but the board's first count layers.
+//   F0 7D 7E F7                          Discards edits.
+//   F0 7D 7F F7                          Commits edits.
+//
+// After a commit, the device replies with F0 7D 7F F7 once the new layout is in use.
+// Edits sent before then are rejected. Layouts loaded by program change aren't acked.
+//
+// (7D is the manufacturer id reserved for non-commercial use.)
+
+namespace layout {
+
+const int maxBoards = 2 * bassboard::maxBoardsPerBus;
+const int maxLayers = 32; // for all boards together
+const int noteCount = music::ChordLimit - music::ChordBase;
+
+enum Output {
+  treble,
+  chord,
+  bass,
+  outputCount
+};
+
+static_assert(outputCount <= bassboard::maxOutputs, "boards can't play on every output");
+
+struct Layer {
+  uint8_t board;
+  uint8_t output;
+  uint8_t velocity; // percent of the output's velocity
+  bassboard::KeyMap map;
+};
+
+struct Layout {
+  Layer layers[maxLayers]; // in order; where layers overlap, the first one sets the velocity
+  int layerCount;
+  uint8_t bottomBass;
+  midi::Channel channel[outputCount];
+  midi::DataByte velocity[outputCount][noteCount];
+
+  // Compiled from the above by compile().
+  bassboard::Routes routes[maxBoards];
+  midi::DataByte noteVelocity[outputCount][noteCount];
+};
+
+const uint8_t manufacturerId = 0x7D;
+
+enum Command : uint8_t {
+  SetKey = 0x01,
+  SetBottomBass = 0x02,
+  SetVelocity = 0x03,
+  SetChannel = 0x04,
+  SetLayer = 0x05,
+  SetLayerCount = 0x06,
+  Discard = 0x7E,
+  Commit = 0x7F,
+};
+
+const byte ackMessage[] = { 0xF0, manufacturerId, Commit, 0xF7 };
+
+const midi::DataByte chordVelocity = 99;
+
+int bassVelocity(music::Note n, music::Note bottomBass) {
+  // Fade out the low and high end of the two octave range starting with bottomBass.
+  // Assumes that bass notes are actually part of an octave interval in that range.
+  // This makes jumping up or down an octave smoother.
+  // See: https://www.accordionists.info/threads/shepard-tone-illusion.5295/
+  int bottomFade = (bottomBass + 5) - n;
+  if (bottomFade > 0) {
+    return 100 - bottomFade * 18;
+  }
+  int topFade = n - (bottomBass + 24 + 7);
+  if (topFade > 0) {
+    return 100 - topFade * 18;
+  }
+  return 100;
+}
+
+// Sets the velocities for an output back to their defaults.
+void setDefaultVelocities(Layout& l, Output out) {
+  for (int i = 0; i < noteCount; i++) {
+    music::Note n = music::ChordBase + i;
+    int v = (out == bass) ? bassVelocity(n, l.bottomBass) : chordVelocity;
+    l.velocity[out][i] = v < 1 ? 1 : (v > 127 ? 127 : v);
+  }
+}
+
+// Merges the layers into the tables used while playing.
+void compile(Layout& l) {
+  for (int b = 0; b < maxBoards; b++) {
+    l.routes[b] = bassboard::noRoutes;
+  }
+  for (int out = 0; out < outputCount; out++) {
+    memcpy(l.noteVelocity[out], l.velocity[out], noteCount);
+  }
+
+  music::Chord velocitySet[outputCount]; // notes whose velocity a layer already set
+  for (int i = 0; i < l.layerCount; i++) {
+    const Layer& layer = l.layers[i];
+    music::Chord played;
+    for (int key = 0; key < bassboard::buttonCount; key++) {
+      music::Chord& dest = l.routes[layer.board].notes[key][layer.output];
+      dest = dest + layer.map.toNote[key];
+      played = played + layer.map.toNote[key];
+    }
+    for (int n = 0; n < noteCount; n++) {
+      music::Note note = music::ChordBase + n;
+      if (!played.has(note) || velocitySet[layer.output].has(note)) continue;
+      int v = l.velocity[layer.output][n] * layer.velocity / 100;
+      l.noteVelocity[layer.output][n] = v < 1 ? 1 : (v > 127 ? 127 : v);
+    }
+    velocitySet[layer.output] = velocitySet[layer.output] + played;
+  }
+}
+
+// Returns the index in l.layers of a board's nth layer, or -1 if it doesn't have one.
+int findLayer(const Layout& l, int board, int n) {
+  for (int i = 0; i < l.layerCount; i++) {
+    if (l.layers[i].board == board && n-- == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Returns how many layers a board has.
+int countLayers(const Layout& l, int board) {
+  int count = 0;
+  for (int i = 0; i < l.layerCount; i++) {
+    if (l.layers[i].board == board) count++;
+  }
+  return count;
+}
+
+Layout buffers[2];
+Layout* active = &buffers[0];
+Layout* back = &buffers[1];
+bool editing = false;
+bool swapPending = false;
+bool commitPending = false; // the pending swap is a SysEx commit
+int boardCount = 0;
+
+uint32_t accepted = 0;
+uint32_t rejected = 0;
+uint32_t swaps = 0;
+
+// Looks up the velocity for a note in the active layout. Can be used as a VelocityFunc.
+template<Output out> midi::DataByte __not_in_flash_func(velocity)(music::Note n) {
+  return active->noteVelocity[out][n - music::ChordBase];
+}
+
+// Compiles the active layout, once its layers are set up. Call before using it.
+void begin(int boards) {
+  boardCount = boards;
+  editing = false;
+  swapPending = false;
+  compile(*active);
+}
+
+static bool startEdit() {
+  if (swapPending) {
+    return false;
+  }
+  if (!editing) {
+    memcpy(back, active, sizeof(Layout));
+    editing = true;
+  }
+  return true;
+}
+
+// Replaces the active layout's layers, keeping its channels and velocities. Like a commit,
+// it takes effect at the next takeSwap(), and replaces any other loadLayers() waiting for
+// it, so the last one wins. Returns false while a SysEx edit or commit is in progress.
+bool loadLayers(const Layer* layers, int count) {
+  if (editing || (swapPending && commitPending) || count > maxLayers) {
+    return false;
+  }
+  memcpy(back, active, sizeof(Layout));
+  memcpy(back->layers, layers, count * sizeof(Layer));
+  back->layerCount = count;
+  compile(*back);
+  swapPending = true;
+  commitPending = false;
+  return true;
+}
+
+static bool isData(const byte* data, unsigned size) {
+  for (unsigned i = 0; i < size; i++) {
+    if (data[i] > 0x7f) return false;
+  }
+  return true;
+}
+
+static bool apply(Command cmd, const byte* args, unsigned argCount) {
+  switch (cmd) {
+    case SetKey: {
+      if (argCount != 13) return false;
+      int board = args[0];
+      int layer = args[1];
+      int key = args[2];
+      if (board >= boardCount || key >= bassboard::buttonCount) return false;
+      uint64_t bits = 0;
+      for (int i = 9; i >= 0; i--) {
+        bits = (bits << 7) | args[3 + i];
+      }
+      if (!startEdit()) return false;
+      int i = findLayer(*back, board, layer);
+      if (i < 0) return false;
+      back->layers[i].map.toNote[key] = music::Chord::fromBits(bits);
+      return true;
+    }
+    case SetBottomBass: {
+      if (argCount != 1) return false;
+      if (args[0] < music::ChordBase.toMidiNumber() || args[0] + 24 >= music::ChordLimit.toMidiNumber()) return false;
+      if (!startEdit()) return false;
+      back->bottomBass = args[0];
+      setDefaultVelocities(*back, bass);
+      return true;
+    }
+    case SetVelocity: {
+      if (argCount < 2) return false;
+      int out = args[0];
+      unsigned start = args[1];
+      unsigned count = argCount - 2;
+      if (out >= outputCount || start + count > (unsigned)noteCount) return false;
+      for (unsigned i = 0; i < count; i++) {
+        if (args[2 + i] == 0) return false; // would be a note off
+      }
+      if (!startEdit()) return false;
+      memcpy(&back->velocity[out][start], args + 2, count);
+      return true;
+    }
+    case SetChannel: {
+      if (argCount != 2) return false;
+      if (args[0] >= outputCount || args[1] < 1 || args[1] > 16) return false;
+      if (!startEdit()) return false;
+      back->channel[args[0]] = args[1];
+      return true;
+    }
+    case SetLayer: {
+      if (argCount != 4) return false;
+      int board = args[0];
+      int layer = args[1];
+      if (board >= boardCount || args[2] >= outputCount || args[3] == 0) return false;
+      if (!startEdit()) return false;
+      int i = findLayer(*back, board, layer);
+      if (i < 0) {
+        if (layer != countLayers(*back, board) || back->layerCount >= maxLayers) return false;
+        i = back->layerCount++;
+        back->layers[i] = Layer{(uint8_t)board, 0, 0, {}};
+      }
+      back->layers[i].output = args[2];
+      back->layers[i].velocity = args[3];
+      return true;
+    }
+    case SetLayerCount: {
+      if (argCount != 2) return false;
+      int board = args[0];
+      int keep = args[1];
+      if (board >= boardCount) return false;
+      if (!startEdit()) return false;
+      int kept = 0;
+      int count = 0;
+      for (int i = 0; i < back->layerCount; i++) {
+        const Layer& layer = back->layers[i];
+        if (layer.board == board && kept++ >= keep) continue;
+        back->layers[count++] = layer;
+      }
+      back->layerCount = count;
+      return true;
+    }
+    case Discard:
+      if (swapPending) return false;
+      editing = false;
+      return true;
+    case Commit:
+      if (!editing || swapPending) return false;
+      compile(*back);
+      editing = false;
+      swapPending = true;
+      commitPending = true;
+      return true;
+  }
+  return false;
+}
+
+// Handles a SysEx message, including the F0 and F7. Messages for other devices are ignored.
+void handleSysEx(byte* data, unsigned size) {
+  if (size < 4 || data[0] != 0xF0 || data[size - 1] != 0xF7 || data[1] != manufacturerId) {
+    return;
+  }
+  const byte* args = data + 3;
+  unsigned argCount = size - 4;
+  if (isData(data + 2, size - 3) && apply((Command)data[2], args, argCount)) {
+    accepted++;
+  } else {
+    rejected++;
+  }
+}
+
+// Makes a committed layout active. Call between frames.
+// Returns true if the layout changed. Sets committed if it came from a SysEx commit,
+// in which case the host is waiting for ackMessage.
+bool takeSwap(bool& committed) {
+  if (!swapPending) {
+    return false;
+  }
+  Layout* prev = active;
+  active = back;
+  back = prev;
+  swapPending = false;
+  committed = commitPending;
+  swaps++;
+  return true;
+}
+
+void printTo(Print& out) {
+  out.print("layout: accepted="); out.print(accepted);
+  out.print(" rejected="); out.print(rejected);
+  out.print(" swaps="); out.print(swaps);
+  out.print(" layers="); out.print(active->layerCount);
+  out.println(editing ? " (editing)" : "");
+}
+
+} // layout
+
+#endif // LAYOUT_H
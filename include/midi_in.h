@@ -0,0 +1,148 @@
+#ifndef MIDI_IN_H
+#define MIDI_IN_H
+
+#include <Arduino.h>
+#include <MIDI.h>
+#include <elapsedMillis.h>
+
+// Reading what the host sends. Input is drained every frame, but only for readBudget,
+// so a flood of messages can't delay the bellows. Anything left is read next frame.
+//
+// Program changes, all notes off and system reset are handled in main.cpp, since they
+// act on the layout and output channels. This keeps counts and follows the MIDI clock.
+
+namespace midiIn {
+
+const int readBudget = 200; // microseconds per frame
+
+// For interfaces that are read with read() below. The library's default parses one byte
+// per call, so a call returns false partway through a message even if the rest is there,
+// which would stop read() long before the input is empty.
+struct Settings : public midi::DefaultSettings {
+  static const bool Use1ByteParsing = false;
+};
+
+struct Stats {
+  uint32_t received;    // all messages
+  uint32_t ignored;     // received but not acted on, such as notes echoed back
+  uint32_t rejected;    // acted on but invalid, such as a program with no preset
+  uint32_t budgetHits;  // frames that stopped reading because the budget ran out
+  uint32_t maxReads;    // most messages read in one frame
+  uint32_t maxReadTime; // microseconds
+
+  void printTo(Print& out) {
+    out.print("received="); out.print(received);
+    out.print(" ignored="); out.print(ignored);
+    out.print(" rejected="); out.print(rejected);
+    out.print(" budgetHits="); out.print(budgetHits);
+    out.print(" maxReads="); out.print(maxReads);
+    out.print(" maxReadTime="); out.print(maxReadTime);
+    out.println(" us");
+  }
+};
+
+Stats stats = {};
+
+// The host's MIDI clock, to line up logged data with its timeline.
+// Times are when the tick was read, so they can be up to a frame late.
+struct Clock {
+  bool running;
+  uint32_t ticks;         // since Start, 24 per quarter note
+  unsigned long lastTick; // micros()
+  uint32_t interval;      // smoothed microseconds between ticks; 0 until known
+  bool measuring;         // false until a tick follows another without a Start or Stop between
+
+  void tick(unsigned long now) {
+    if (measuring) {
+      uint32_t elapsed = now - lastTick;
+      interval = (interval == 0) ? elapsed : interval + ((int32_t)(elapsed - interval) >> 3);
+    }
+    measuring = true;
+    lastTick = now;
+    ticks++;
+  }
+
+  // Beats per minute, or 0 if not known.
+  float tempo() {
+    return interval == 0 ? 0 : 60000000.0f / (24 * interval);
+  }
+
+  void printTo(Print& out) {
+    out.print("clock: "); out.print(running ? "running" : "stopped");
+    out.print(" ticks="); out.print(ticks);
+    out.print(" interval="); out.print(interval);
+    out.print(" us tempo="); out.println(tempo(), 1);
+  }
+};
+
+Clock clock = {};
+
+void handleClock() {
+  clock.tick(micros());
+}
+
+void handleStart() {
+  clock.running = true;
+  clock.ticks = 0;
+  clock.measuring = false;
+}
+
+void handleContinue() {
+  clock.running = true;
+  clock.measuring = false;
+}
+
+void handleStop() {
+  clock.running = false;
+  clock.measuring = false;
+}
+
+// Sets up the handlers for clock messages.
+template<class Interface> void begin(Interface& in) {
+  in.setHandleClock(handleClock);
+  in.setHandleStart(handleStart);
+  in.setHandleContinue(handleContinue);
+  in.setHandleStop(handleStop);
+}
+
+// Returns true for types that something here or in main.cpp acts on.
+bool handled(midi::MidiType type) {
+  switch (type) {
+    case midi::ProgramChange:
+    case midi::ControlChange:
+    case midi::SystemExclusive:
+    case midi::Clock:
+    case midi::Start:
+    case midi::Continue:
+    case midi::Stop:
+    case midi::SystemReset:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Reads and dispatches messages until the input is empty or readBudget is used up.
+template<class Interface> void read(Interface& in) {
+  elapsedMicros sinceStart;
+  uint32_t reads = 0;
+  bool more;
+  while ((more = in.read())) {
+    reads++;
+    stats.received++;
+    if (!handled(in.getType())) {
+      stats.ignored++;
+    }
+    if (sinceStart >= (unsigned long)readBudget) {
+      break;
+    }
+  }
+  if (more) stats.budgetHits++;
+  if (reads > stats.maxReads) stats.maxReads = reads;
+  uint32_t elapsed = sinceStart;
+  if (elapsed > stats.maxReadTime) stats.maxReadTime = elapsed;
+}
+
+} // midiIn
+
+#endif // MIDI_IN_H
@@ -5,37 +5,215 @@
 #include <MIDI.h>
 #include <music.h>
 
+#include "midi_in.h"
+
 namespace midiOut {
 
+// Transports.
+// A Channel can send to any type with sendNoteOn, sendNoteOff and sendControlChange
+// methods taking the same arguments as midi::MidiInterface. Since the transport is a
+// template parameter, calls are resolved at compile time.
+
+// USB device MIDI. Also where input from the host is read.
 Adafruit_USBD_MIDI midiDev;
-MIDI_CREATE_INSTANCE(Adafruit_USBD_MIDI, midiDev, MID);
+MIDI_CREATE_CUSTOM_INSTANCE(Adafruit_USBD_MIDI, midiDev, MID, midiIn::Settings);
+typedef decltype(MID) UsbTransport;
+
+// DIN MIDI over a UART. Uses running status to save a byte on repeated messages.
+struct DinSettings : public midi::DefaultSettings {
+  static const bool UseRunningStatus = true;
+};
+MIDI_CREATE_CUSTOM_INSTANCE(SerialUART, Serial1, DIN, DinSettings);
+typedef decltype(DIN) DinTransport;
+
+// Records messages in memory instead of sending them.
+// Useful for counting messages and bytes without any hardware attached.
+template<int capacity> class RecordingTransport {
+public:
+  struct Message {
+    midi::StatusByte status; // includes the channel
+    midi::DataByte data1;
+    midi::DataByte data2;
+  };
+
+  Message messages[capacity];
+  int count = 0;        // messages recorded (not more than capacity)
+  long total = 0;       // messages sent, including any that didn't fit
+  long bytes = 0;       // bytes that would be sent without running status
+  long runningBytes = 0; // bytes that would be sent with running status
+
+  void sendNoteOn(midi::DataByte note, midi::DataByte velocity, midi::Channel chan) {
+    record(midi::NoteOn, note, velocity, chan);
+  }
+
+  void sendNoteOff(midi::DataByte note, midi::DataByte velocity, midi::Channel chan) {
+    record(midi::NoteOff, note, velocity, chan);
+  }
+
+  void sendControlChange(midi::DataByte control, midi::DataByte value, midi::Channel chan) {
+    record(midi::ControlChange, control, value, chan);
+  }
+
+  void clear() {
+    count = 0;
+    total = 0;
+    bytes = 0;
+    runningBytes = 0;
+    lastStatus = 0;
+  }
+
+private:
+  midi::StatusByte lastStatus = 0;
+
+  void record(midi::MidiType type, midi::DataByte data1, midi::DataByte data2, midi::Channel chan) {
+    midi::StatusByte status = type | ((chan - 1) & 0x0f);
+    if (count < capacity) {
+      messages[count] = Message{status, data1, data2};
+      count++;
+    }
+    total++;
+    bytes += 3;
+    runningBytes += (status == lastStatus) ? 2 : 3;
+    lastStatus = status;
+  }
+};
 
 const int maxControlValue = (1 << 14) - 1;
 
 void begin() {
-  MID.begin();
+  MID.begin(MIDI_CHANNEL_OMNI);
+  MID.turnThruOff(); // don't echo what the host sends
+}
+
+void beginDin() {
+  DIN.begin();
 }
 
 typedef midi::DataByte (*VelocityFunc)(music::Note n);
 
-template<VelocityFunc velocity> class Channel  {
+// What coalescing chord changes saved and cost, for one channel.
+struct CoalesceStats {
+  uint32_t wanted;     // note messages that sending every change at once would have taken
+  uint32_t sent;       // note messages actually sent
+  uint32_t held;       // chord changes that waited for the window
+  uint32_t maxDelay;   // microseconds
+  uint64_t totalDelay; // microseconds
+
+  void clear() {
+    wanted = 0;
+    sent = 0;
+    held = 0;
+    maxDelay = 0;
+    totalDelay = 0;
+  }
+
+  void printTo(Print& out) {
+    out.print("saved="); out.print(wanted - sent);
+    out.print(" of "); out.print(wanted);
+    out.print(" held="); out.print(held);
+    out.print(" avgDelay="); out.print(held == 0 ? 0 : (uint32_t)(totalDelay / held));
+    out.print(" maxDelay="); out.print(maxDelay);
+    out.println(" us");
+  }
+};
+
+template<class Transport, VelocityFunc velocity> class Channel  {
+  Transport& out;
   midi::Channel chan;
-  music::Chord prev;
-  midi::DataByte prevControlValue = -1;
+  music::Chord prev;   // as sent
+  music::Chord latest; // as last requested
+  int16_t prevControlValue[128]; // by control number; -1 if not sent yet
+
+  unsigned long coalesceWindow = 0;
+  bool pending = false;
+  unsigned long pendingSince = 0;
 
 public:
-  Channel(midi::Channel channelNumber): chan(channelNumber) {}
+  CoalesceStats stats = {};
+  unsigned long lastHold = 0; // microseconds the last change sent was held for coalescing
+
+  Channel(Transport& transport, midi::Channel channelNumber): out(transport), chan(channelNumber) {
+    forgetControlValues();
+  }
+
+  // Forgets the control values sent, so each control is sent again on its next update,
+  // even if unchanged. For when the receiver may have lost them, such as after USB reconnects.
+  void forgetControlValues() {
+    for (int i = 0; i < 128; i++) {
+      prevControlValue[i] = -1;
+    }
+  }
+
+  midi::Channel channel() const {
+    return chan;
+  }
+
+  // Forgets which notes are on, for when the receiver has turned them all off itself.
+  // Buttons still held will play again on the next sendChord.
+  void forgetNotes() {
+    prev = music::Chord();
+    latest = music::Chord();
+    pending = false;
+  }
 
+  // Holds chord changes for this many microseconds after the first one, so that buttons
+  // pressed or released together (even on different boards) are sent as one change, and
+  // notes that flip on and off within the window aren't sent at all. 0 sends every change
+  // immediately.
+  void setCoalesceWindow(unsigned long micros) {
+    coalesceWindow = micros;
+  }
+
+  // Switches to a different MIDI channel, turning off any notes on the old one.
+  void setChannel(midi::Channel channelNumber) {
+    if (channelNumber == chan) {
+      return;
+    }
+    sendAllNotesOff();
+    chan = channelNumber;
+    forgetControlValues();
+  }
+
+  // Sends the notes that changed since the last chord sent. Call every frame, even if the
+  // chord is the same, so that changes held for coalescing are sent on time.
+  // Returns true if anything was sent.
   bool sendChord(music::Chord chord) {
+    stats.wanted += chord.countChanges(latest);
+    latest = chord;
+
+    lastHold = 0;
+    if (coalesceWindow > 0) {
+      if (chord == prev) {
+        pending = false; // any changes cancelled out
+        return false;
+      }
+      unsigned long now = micros();
+      if (!pending) {
+        pending = true;
+        pendingSince = now;
+      }
+      unsigned long delay = now - pendingSince;
+      if (delay < coalesceWindow) {
+        return false;
+      }
+      pending = false;
+      lastHold = delay;
+      stats.held++;
+      stats.totalDelay += delay;
+      if (delay > stats.maxDelay) stats.maxDelay = delay;
+    }
+
     bool changed = false;
 
     for (music::Note n = music::ChordBase; n < music::ChordLimit; n = n + 1) {
           if (chord.has(n) && !prev.has(n)) {
-            MID.sendNoteOn(n.toMidiNumber(), velocity(n), chan);
+            out.sendNoteOn(n.toMidiNumber(), velocity(n), chan);
             changed = true;
+            stats.sent++;
           } else if (prev.has(n) && !chord.has(n)) {
-            MID.sendNoteOff(n.toMidiNumber(), 0, chan);
+            out.sendNoteOff(n.toMidiNumber(), 0, chan);
             changed = true;
+            stats.sent++;
           }
       }
       prev = chord;
@@ -43,19 +221,22 @@ public:
   }
 
   void sendAllNotesOff() {
-    MID.sendControlChange(123, 0, chan); // all notes off
+    out.sendControlChange(123, 0, chan); // all notes off
     prev = music::Chord();
+    latest = music::Chord();
+    pending = false;
   }
 
-  // Sends a 7-bit control change.
-  void __not_in_flash_func(sendControlChange)(int control, int value) {
+  // Sends a 7-bit control change. Returns true if a message was sent.
+  bool __not_in_flash_func(sendControlChange)(int control, int value) {
     if (value < 0) value = 0;
     if (value > 127) value = 127;
-    if (value == prevControlValue) {
-      return;
+    if (value == prevControlValue[control]) {
+      return false;
     }
-    MID.sendControlChange(control, value, chan);
-    prevControlValue = value;
+    out.sendControlChange(control, value, chan);
+    prevControlValue[control] = value;
+    return true;
   }
 
   // Sends a 14-bit control change using two control numbers.
@@ -66,16 +247,16 @@ public:
     // See discussion at: https://community.vcvrack.com/t/14-bit-midi-in-1-0/1779/86
     if (value < 0) value = 0;
     if (value > maxControlValue) value = maxControlValue;
-    if (value == prevControlValue) {
+    if (value == prevControlValue[control]) {
       return;
     }
     //Serial.println(val);
 
     midi::DataByte lo = value & 0x7f;
     midi::DataByte hi = value >> 7;
-    MID.sendControlChange(control + 32, hi, chan);
-    MID.sendControlChange(control, lo, chan);
-    prevControlValue = value;
+    out.sendControlChange(control + 32, hi, chan);
+    out.sendControlChange(control, lo, chan);
+    prevControlValue[control] = value;
   }
 };
 
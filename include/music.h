@@ -111,6 +111,15 @@ public:
   constexpr Chord(Note n1, Note n2) : bits(toBit(n1) | toBit(n2)) {}
   constexpr Chord(Note n1, Note n2, Note n3) : bits(toBit(n1) | toBit(n2) | toBit(n3)) {}
 
+  // Bit i is set if the chord has note ChordBase + i.
+  constexpr static Chord fromBits(uint64_t bitset) {
+    return Chord(bitset);
+  }
+
+  constexpr uint64_t toBits() const {
+    return bits;
+  }
+
   constexpr Chord static doubleOctave(Note n) {
     return Chord(octaveBits(n));
   }
@@ -139,6 +148,19 @@ public:
     return Chord(toBit(n) | toBit(n + 3) | toBit(n - 5));
   }
 
+  constexpr bool operator ==(const Chord other) const {
+    return bits == other.bits;
+  }
+
+  constexpr bool operator !=(const Chord other) const {
+    return bits != other.bits;
+  }
+
+  // Returns the number of notes in one chord but not the other.
+  int countChanges(const Chord other) const {
+    return __builtin_popcountll(bits ^ other.bits);
+  }
+
   // Returns the union of the notes in both chords.
   constexpr Chord operator +(const Chord other) const {
     return Chord(bits | other.bits);
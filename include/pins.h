@@ -9,6 +9,7 @@ namespace sensor {
   const int aSensorPin = A0;
   const int bSensorPin = A1;
   const int powerPin = 22;
+  const int expressionPin = A2; // A3 measures VSYS on a Pico, so this is the last free input
 }
 
 #endif
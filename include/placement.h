@@ -0,0 +1,26 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <Arduino.h>
+
+// Memory placement for the hot path.
+//
+// The RP2040 has four striped SRAM banks shared by both cores, plus two 4k scratch banks.
+// Code and data that only one core touches go in that core's scratch bank, so the sensor
+// loop on core 1 never waits on core 0 (or DMA) for the bus, and vice versa.
+// Each scratch bank also holds a stack (scratch Y has core 0's, 2k by default), so keep
+// what goes there small: per-sample state and scalars, not tables or anything the other
+// core reads. scripts/memory_report.py prints how full each bank is after linking.
+//
+// Anything else that runs every frame should at least be in RAM (__not_in_flash_func),
+// since a miss in the XIP cache stalls for a flash read.
+
+// Core 1 (sensor loop): scratch X.
+#define CORE1_DATA __scratch_x("core1")
+#define CORE1_FUNC(func_name) __scratch_x(__STRING(func_name)) func_name
+
+// Core 0 (control loop): scratch Y. Only for a few hot scalars, since it shares the bank
+// with core 0's stack.
+#define CORE0_DATA __scratch_y("core0")
+
+#endif // PLACEMENT_H
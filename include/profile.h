@@ -0,0 +1,68 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include "Print.h"
+
+// Scoped timing probes for hot code.
+// Build with -DPROFILE to enable them. Otherwise, PROFILE_SECTION compiles to nothing.
+//
+// On the RP2040, times are in CPU cycles. In a host build, they're in nanoseconds.
+
+namespace profile {
+
+enum Section {
+  ReadAndCalculate,
+  CalculatePhase,
+  CountLaps,
+  CalculateLaps,
+  AdjustWeights,
+  AdjustLaps,
+  PollBoards,
+  SendTreble,
+  SendChord,
+  SendBass,
+  sectionCount
+};
+
+const int coreCount = 2;
+
+struct Stats {
+  uint32_t count;
+  uint64_t total;
+  uint32_t max;
+};
+
+// Indexed by core, then section. Each core only writes its own row.
+extern Stats stats[coreCount][sectionCount];
+
+uint32_t now();
+
+void record(Section section, uint32_t elapsed);
+
+void clear();
+
+// Prints a line for each section that ran on either core.
+void printTo(Print& out);
+
+class Probe {
+public:
+  Probe(Section s) : section(s), start(now()) {}
+  ~Probe() {
+    record(section, now() - start);
+  }
+
+private:
+  Section section;
+  uint32_t start;
+};
+
+} // profile
+
+#ifdef PROFILE
+#define PROFILE_SECTION(name) profile::Probe profileProbe(profile::name)
+#else
+#define PROFILE_SECTION(name)
+#endif
+
+#endif // PROFILE_H
@@ -4,15 +4,21 @@
 #include <elapsedMillis.h>
 #include <limits.h>
 
+namespace bench { class Runner; }
+
 namespace sensor {
 
 const int ticksPerTurn = 720;
+const int halfTurn = ticksPerTurn/2;
+const int quarterTurn = ticksPerTurn/4;
+const int eighthTurn = ticksPerTurn/8;
 
 struct Reading {
   int a;
   int b;
   int theta;
   int laps;
+  unsigned long sampleTime; // micros() when the sample was taken
 
   int jitter;
   int aReadTime;
@@ -21,28 +27,102 @@ struct Reading {
 };
 
 
+// The ellipse traced by the A and B readings, as currently fitted.
+struct Ellipse {
+  float centreA;
+  float centreB;
+  float radiusA;
+  float radiusB;
+  float skew; // sine of the phase error between A and B
+  bool fitted;
+};
+
+// Extra analog inputs, such as expression pedals and knobs.
+// The bellows sensor pair is read every sample period; these are read in the time left over,
+// at most one per period, so they don't add jitter to the bellows readings.
+//
+// There's no output for a second phase pair. The bellows pair isn't an entry here, since
+// it's the timed read that every sample period is scheduled around, and it feeds the
+// ellipse fit and lap counting rather than a filter.
+
+enum AnalogOutput {
+  Raw,           // reported, but not sent
+  ControlChange, // sent as a 7-bit control change
+};
+
+struct AnalogChannel {
+  const char* name;
+  int pin;
+  int divider;   // read once every this many sample periods, which vary with the adaptive
+                 // rate: a divider of 5 reads at 100 Hz at rest and 400 Hz when fast
+  int smoothing; // filter strength; each read moves the value 1/2^smoothing of the way
+  AnalogOutput output;
+  int control;   // for ControlChange
+};
+
+const int maxAnalogChannels = 2;
+
+extern const AnalogChannel analogChannels[];
+extern const int analogChannelCount;
+
+struct AnalogReading {
+  int value;       // filtered, 0 to 1023
+  int reads;       // since the last report
+  int maxJitter;   // microseconds after the start of its sample period
+  int maxReadTime; // microseconds
+};
+
 struct Report {
   Reading last;
+  Ellipse ellipse;
+  AnalogReading analog[maxAnalogChannels];
   int samples;
   int thetaChange;
   int maxJitter;
   int minIdle;
   int sendTime;
+  int samplePeriod; // microseconds between samples in this report
+  int duration;     // microseconds covered by this report
+  int speed;        // tracked angular velocity, in ticks per second
+  int jumps;        // samples since startup that were too far from where the magnet should be
 
   void clear() {
     samples = 0;
     thetaChange = 0;
     maxJitter = 0;
     minIdle = INT_MAX;
+    for (int i = 0; i < maxAnalogChannels; i++) {
+      analog[i].reads = 0;
+      analog[i].maxJitter = 0;
+      analog[i].maxReadTime = 0;
+    }
   }
 };
 
+// How the sensor warmup at startup went. Written by core 1 before its first report.
+struct Warmup {
+  unsigned long doneTime; // micros() when sampling started
+  int reads;
+  bool settled; // false if it gave up waiting
+};
+
+extern Warmup warmup;
+
+// Powers the sensor and sets up the ADC. Core 1 waits for this before its warmup.
 void begin();
 
 Report* takeReport(Report* nextDest);
 
 void runReadLoop();
 
+// The fastest the bellows can turn, in ticks per second, before lap counting sees a jump.
+// Because the velocity is tracked, this really limits how much the speed can change
+// between samples; from a standstill, it's the top speed. Steady motion up to twice as
+// fast is still counted, but only after a few samples (see laps.h).
+int maxSafeSpeed(int samplePeriod);
+
+void runBenchmarks(bench::Runner& runner);
+
 } // sensor
 
 #endif // SENSOR_H
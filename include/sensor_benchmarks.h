@@ -0,0 +1,45 @@
+#ifndef SENSOR_BENCHMARKS_H
+#define SENSOR_BENCHMARKS_H
+
+#include <math.h>
+
+#include "bench.h"
+#include "ellipse.h"
+#include "laps.h"
+
+namespace sensor {
+
+// Benchmarks the header-only tracking code, for sensor::runBenchmarks on the device and
+// the native benchmarks (test/test_bench). Uses separate state, so it can run on core 0
+// while core 1 is sampling.
+void runTrackingBenchmarks(bench::Runner& runner) {
+  static LapCounter lc;
+  static Report rep;
+  lc = LapCounter();
+  rep.clear();
+  runner.run("countLaps", 1000, [&](int i) {
+    rep.last.theta = (i * 37) % ticksPerTurn; // about 18 degrees per sample
+    rep.last.sampleTime = i * 1000;
+    countLaps(lc, rep);
+  });
+  bench::keep(rep.last.laps);
+
+  const int inputCount = 64;
+  static int as[inputCount];
+  static int bs[inputCount];
+  for (int i = 0; i < inputCount; i++) {
+    float angle = i * 2 * M_PI / inputCount;
+    as[i] = defaultCentre + cosf(angle) * 150;
+    bs[i] = defaultCentre + sinf(angle + 0.1) * 120;
+  }
+
+  static EllipseFit ellipse;
+  ellipse = EllipseFit();
+  runner.run("EllipseFit::add", 1000, [&](int i) {
+    ellipse.add(as[i % inputCount], bs[i % inputCount]);
+  });
+}
+
+} // sensor
+
+#endif // SENSOR_BENCHMARKS_H
@@ -0,0 +1,84 @@
+# Reports whether hot-path symbols ended up in flash or RAM after linking.
+# Run by PlatformIO as a post-build step (see extra_scripts in platformio.ini).
+
+Import("env")
+
+import re
+import subprocess
+
+# Functions and data touched every sample or every frame.
+HOT_SYMBOLS = [
+    # core 1
+    r"sensor::runReadLoop", r"sensor::readAndCalculate", r"sensor::takeTimedReading",
+    r"sensor::takeReading", r"sensor::calculatePhase", r"sensor::approximatePhase",
+    r"sensor::countLaps", r"sensor::sendReport", r"sensor::buffer1", r"sensor::buffer2",
+    # core 0
+    r"calibration::", r"calculateLaps", r"bellowsResponse", r"layout::velocity<",
+    r"pollBoards", r"bassboard::Board::poll", r"boards",
+    r"midiOut::Channel<.*>::send",
+]
+
+# Scratch banks and the sections that go in them, including the stack reserved there.
+BANK_SIZE = 4096
+BANKS = {
+    "scratchX": [".scratch_x", ".stack1_dummy"],
+    "scratchY": [".scratch_y", ".stack_dummy"],
+}
+
+REGIONS = [
+    (0x10000000, 0x11000000, "flash"),
+    (0x20000000, 0x20040000, "sram"),
+    (0x20040000, 0x20041000, "scratchX"),
+    (0x20041000, 0x20042000, "scratchY"),
+]
+
+def region(addr):
+    for start, end, name in REGIONS:
+        if start <= addr < end:
+            return name
+    return "other"
+
+def section_sizes(env, elf):
+    size = env.subst("$CC").replace("gcc", "size")
+    out = subprocess.run([size, "-A", elf], capture_output=True, text=True, check=True).stdout
+    sizes = {}
+    for line in out.splitlines():
+        parts = line.split()
+        if len(parts) == 3 and parts[0].startswith("."):
+            sizes[parts[0]] = int(parts[1])
+    return sizes
+
+def report_banks(env, elf):
+    sizes = section_sizes(env, elf)
+    print("Scratch banks:")
+    for bank, sections in BANKS.items():
+        used = sum(sizes.get(s, 0) for s in sections)
+        detail = ", ".join("%s %d" % (s, sizes.get(s, 0)) for s in sections)
+        print("  %-9s %5d of %d bytes (%s)" % (bank, used, BANK_SIZE, detail))
+        if used > BANK_SIZE:
+            print("Warning: %s is over by %d bytes; its stack will overwrite data" % (bank, used - BANK_SIZE))
+
+def report(source, target, env):
+    elf = str(target[0])
+    report_banks(env, elf)
+    nm = env.subst("$CC").replace("gcc", "nm")
+    out = subprocess.run([nm, "-C", "-S", "--size-sort", elf],
+                         capture_output=True, text=True, check=True).stdout
+    hot = [re.compile(p) for p in HOT_SYMBOLS]
+    inFlash = 0
+    print("Hot-path placement:")
+    for line in out.splitlines():
+        parts = line.split(None, 3)
+        if len(parts) < 4:
+            continue
+        addr, size, kind, name = parts
+        if not any(p.search(name) for p in hot):
+            continue
+        where = region(int(addr, 16))
+        if where == "flash" and kind in "tT":
+            inFlash += 1
+        print("  %-9s %6d  %s" % (where, int(size, 16), name))
+    if inFlash:
+        print("Warning: %d hot functions execute from flash" % inFlash)
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", report)
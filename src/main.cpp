@@ -4,6 +4,7 @@
 
 #include <elapsedMillis.h>
 #include <math.h>
+#include <hardware/watchdog.h>
 
 #include "pins.h"
 
@@ -13,8 +14,74 @@
 #include "bassboard.h"
 #include "bassmaps.h"
 #include "midi_out.h"
+#include "midi_in.h"
+#include "latency.h"
+#include "profile.h"
+#include "placement.h"
+#include "busperf.h"
+#include "layout.h"
+#include "bench_budgets.h"
+#include "benchmarks.h"
+#include "deadline.h"
+#include "boot.h"
+
+// Buttons are read from MCP23017 boards, up to eight per i2c bus.
+// For more boards, add a second bus using Wire1 on other pins.
+
+const uint32_t i2cClock = 400000; // 1000000 for Fast-mode Plus, if the pullups are strong enough
+// Bounds the cost of a transfer that a device stalls partway through. This is in whole
+// milliseconds, so it can't be made shorter than scanBudget: a bus that's already stuck
+// is caught before each read instead, and a board that doesn't answer fails at once.
+const int i2cTimeout = 1; // milliseconds
+
+bassboard::Bus bus0(Wire, dataPin, clockPin, i2cClock);
+
+bassboard::Bus* buses[] = { &bus0 };
+
+bassboard::Board boards[] = {
+  bassboard::Board("lower", bus0, bassboard::firstAddress),
+  bassboard::Board("upper", bus0, bassboard::firstAddress + 1),
+};
+
+const int boardCount = sizeof(boards) / sizeof(boards[0]);
+const int busCount = sizeof(buses) / sizeof(buses[0]);
+static_assert(boardCount <= bassboard::maxBoardsPerBus * busCount, "too many boards for the number of buses");
+
+// What the buttons play until a layout is sent over SysEx: board, output, velocity percent
+// and key map. Add layers here for octave doublings or splits.
+const layout::Layer defaultLayers[] = {
+  { 0, layout::chord, 100, bassmaps::lowerChordCustom },
+  { 0, layout::bass, 100, bassmaps::lowerBass },
+  { 1, layout::chord, 100, bassmaps::upperChordCustom },
+  { 1, layout::bass, 100, bassmaps::upperBass },
+};
+
+const int defaultLayerCount = sizeof(defaultLayers) / sizeof(defaultLayers[0]);
+static_assert(defaultLayerCount <= layout::maxLayers, "too many layers");
+
+// The standard chord layout, for instruments without the custom chord mapping.
+const layout::Layer standardLayers[] = {
+  { 0, layout::chord, 100, bassmaps::lowerChord },
+  { 0, layout::bass, 100, bassmaps::lowerBass },
+  { 1, layout::chord, 100, bassmaps::upperChord },
+  { 1, layout::bass, 100, bassmaps::upperBass },
+};
+
+// Layouts that a MIDI program change can switch to, by program number.
+struct Preset {
+  const layout::Layer* layers;
+  int layerCount;
+};
+
+const Preset presets[] = {
+  { defaultLayers, defaultLayerCount },
+  { standardLayers, sizeof(standardLayers) / sizeof(standardLayers[0]) },
+};
+
+const int presetCount = sizeof(presets) / sizeof(presets[0]);
 
-const int boardCount = 2;
+// Limits the time spent reading boards in each frame. Boards that don't fit are read next time.
+const int scanBudget = 400; // microseconds
 
 struct LapMetrics {
   float laps;
@@ -24,11 +91,13 @@ struct LapMetrics {
   int midiValue;
 };
 
+// Per report of referenceDuration. Scaled for other report durations.
 const float maxLeakage = 0.01;
 const float pressureDecay = 0.96;
+const int referenceDuration = calibration::referenceDuration;
 
-float pressure = 0;
-float prevAdjustedLaps = nanf("");
+CORE0_DATA float pressure = 0;
+CORE0_DATA float prevAdjustedLaps = nanf("");
 
 float __not_in_flash_func(bellowsResponse)(float x) {
   if (x >= 12) return 127;
@@ -36,7 +105,22 @@ float __not_in_flash_func(bellowsResponse)(float x) {
   return 127-0.7*(x*x)+2*x;
 }
 
-LapMetrics __not_in_flash_func(calculateLaps)(sensor::Reading reading) {
+// The pressure decay for a report of the given duration.
+// Calculated only when the duration changes, since powf is slow.
+float __not_in_flash_func(decayFor)(int duration) {
+  static int lastDuration = referenceDuration;
+  static float lastDecay = pressureDecay;
+  if (duration != lastDuration) {
+    lastDecay = powf(pressureDecay, duration / (float)referenceDuration);
+    lastDuration = duration;
+  }
+  return lastDecay;
+}
+
+LapMetrics __not_in_flash_func(calculateLaps)(const sensor::Report& report) {
+    PROFILE_SECTION(CalculateLaps);
+    const sensor::Reading& reading = report.last;
+    float leakage = maxLeakage * report.duration / referenceDuration;
     LapMetrics lm;
     lm.laps = reading.laps + reading.theta / ((float)sensor::ticksPerTurn);
 
@@ -49,13 +133,13 @@ LapMetrics __not_in_flash_func(calculateLaps)(sensor::Reading reading) {
       pressure += lapsChange;
     }
 
-    if (fabs(pressure) < maxLeakage) {
+    if (fabs(pressure) < leakage) {
       pressure = 0;
     } else {
-      pressure += (pressure > 0) ? -maxLeakage : maxLeakage;
+      pressure += (pressure > 0) ? -leakage : leakage;
     }
 
-    pressure *= pressureDecay;
+    pressure *= decayFor(report.duration);
     lm.airflow = fabs(pressure);
 
     lm.midiValue = calibration::calibrated() ? floor(bellowsResponse(fabs(lm.airflow))) : 0;
@@ -67,40 +151,45 @@ LapMetrics __not_in_flash_func(calculateLaps)(sensor::Reading reading) {
 
 struct BassReadings {
   bassboard::Reading reading[boardCount];
-  music::Chord chord;
-  music::Chord bass;
+  music::Chord notes[layout::outputCount]; // from all boards
+  unsigned long pollTime; // when the earliest change was seen
 };
 
-midi::DataByte chordVelocity(music::Note n) {
-  return 99;
-}
+typedef midiOut::UsbTransport Transport;
 
-midi::DataByte bassVelocity(music::Note n) {
-  // Fade out the low and high end of the two octave range starting with bottomBass.
-  // Assumes that bass notes are actually part of an octave interval in that range.
-  // This makes jumping up or down an octave smoother.
-  // See: https://www.accordionists.info/threads/shepard-tone-illusion.5295/
-  int bottomFade = (bassmaps::bottomBass + 5) - n;
-  if (bottomFade > 0) {
-    return 100 - bottomFade * 18;
-  }
-  int topFade = n - (bassmaps::bottomBass + 24 + 7);
-  if (topFade > 0) {
-    return 100 - topFade * 18;
-  }
-  return 100;
-}
+midiOut::Channel<Transport, layout::velocity<layout::treble>> trebleChannel(midiOut::MID, 1);
+midiOut::Channel<Transport, layout::velocity<layout::chord>> chordChannel(midiOut::MID, 2);
+midiOut::Channel<Transport, layout::velocity<layout::bass>> bassChannel(midiOut::MID, 3);
 
-midiOut::Channel<chordVelocity> trebleChannel(1);
-midiOut::Channel<chordVelocity> chordChannel(2);
-midiOut::Channel<bassVelocity> bassChannel(3);
+// How long to gather button changes into one chord change, in microseconds.
+// Something like 5000 merges buttons pressed together, at the cost of that much latency.
+const unsigned long coalesceWindow = 0;
 
 const int bellowsControl = 1; // mod wheel
 
+void sendAnalogControls(sensor::Report& r) {
+  for (int i = 0; i < sensor::analogChannelCount; i++) {
+    const sensor::AnalogChannel& ch = sensor::analogChannels[i];
+    if (ch.output != sensor::ControlChange) continue;
+    int value = r.analog[i].value >> 3;
+    trebleChannel.sendControlChange(ch.control, value);
+    chordChannel.sendControlChange(ch.control, value);
+    bassChannel.sendControlChange(ch.control, value);
+  }
+}
+
 void printHeader() {
-  Serial.println("\nMIDIValue,Airflow,AdjustedDelta,AdjustedLaps,Laps,WeightUpdates,Bin,binWeight,binAdjustment,a,b,theta,thetaChange,"
+  Serial.print("\nMIDIValue,Airflow,AdjustedDelta,AdjustedLaps,Laps,WeightUpdates,Confidence,Bin,binWeight,binAdjustment,a,b,centreA,centreB,radiusA,radiusB,skew,theta,thetaChange,"
       "chordNotesOn,bassNotesOn,"
-      "jitter,aReadTime,bReadTime,totalReadTime,maxJitter,minIdle,sendTime");
+      "jitter,aReadTime,bReadTime,totalReadTime,maxJitter,minIdle,sendTime,samplePeriod,speed,jumps,clockTicks,sinceClock");
+  for (int i = 0; i < sensor::analogChannelCount; i++) {
+    const char* name = sensor::analogChannels[i].name;
+    Serial.print(","); Serial.print(name);
+    Serial.print(","); Serial.print(name); Serial.print("Reads");
+    Serial.print(","); Serial.print(name); Serial.print("MaxJitter");
+    Serial.print(","); Serial.print(name); Serial.print("MaxReadTime");
+  }
+  Serial.println();
   Serial.flush();
 }
 
@@ -112,17 +201,23 @@ void __not_in_flash_func(printLine)(LapMetrics lm, calibration::WeightMetrics wm
   Serial.print(lm.laps, 4); Serial.print(", ");
 
   Serial.print(wm.updateCount); Serial.print(", ");
+  Serial.print(wm.confidence, 3); Serial.print(", ");
   Serial.print(wm.bin); Serial.print(", ");
   Serial.print(wm.binWeight, 4); Serial.print(", ");
   Serial.print(wm.binAdjustment, 4); Serial.print(", ");
 
   Serial.print(r.last.a); Serial.print(", ");
   Serial.print(r.last.b); Serial.print(", ");
+  Serial.print(r.ellipse.centreA, 1); Serial.print(", ");
+  Serial.print(r.ellipse.centreB, 1); Serial.print(", ");
+  Serial.print(r.ellipse.radiusA, 1); Serial.print(", ");
+  Serial.print(r.ellipse.radiusB, 1); Serial.print(", ");
+  Serial.print(r.ellipse.skew, 4); Serial.print(", ");
   Serial.print(r.last.theta * 360.0 / sensor::ticksPerTurn); Serial.print(", ");
   Serial.print(r.thetaChange * 360.0 / sensor::ticksPerTurn); Serial.print(", ");
 
-  Serial.print(br.chord.countNotes()); Serial.print(",");
-  Serial.print(br.bass.countNotes()); Serial.print(",");
+  Serial.print(br.notes[layout::chord].countNotes()); Serial.print(",");
+  Serial.print(br.notes[layout::bass].countNotes()); Serial.print(",");
 
   Serial.print(r.last.jitter); Serial.print(", ");
   Serial.print(r.last.aReadTime); Serial.print(", ");
@@ -130,78 +225,401 @@ void __not_in_flash_func(printLine)(LapMetrics lm, calibration::WeightMetrics wm
   Serial.print(r.last.totalReadTime); Serial.print(", ");
   Serial.print(r.maxJitter); Serial.print(", ");
   Serial.print(r.minIdle); Serial.print(", ");
-  Serial.println(r.sendTime);
+  Serial.print(r.sendTime); Serial.print(", ");
+  Serial.print(r.samplePeriod); Serial.print(", ");
+  Serial.print(r.speed); Serial.print(", ");
+  Serial.print(r.jumps); Serial.print(", ");
+  Serial.print(midiIn::clock.ticks); Serial.print(", ");
+  Serial.print(micros() - midiIn::clock.lastTick);
+  for (int i = 0; i < sensor::analogChannelCount; i++) {
+    Serial.print(", "); Serial.print(r.analog[i].value);
+    Serial.print(", "); Serial.print(r.analog[i].reads);
+    Serial.print(", "); Serial.print(r.analog[i].maxJitter);
+    Serial.print(", "); Serial.print(r.analog[i].maxReadTime);
+  }
+  Serial.println();
   Serial.flush();
 }
 
-bassboard::Board boards[boardCount] = {
-  bassboard::Board("lower", Wire, 32, &bassmaps::lowerChordCustom, &bassmaps::lowerBass),
-  bassboard::Board("upper", Wire, 33, &bassmaps::upperChordCustom, &bassmaps::upperBass)
-};
-
-elapsedMillis sinceValidRead;
+BassReadings lastReadings;
+int nextBoard = 0;
+int nextProbe = 0;
+
+// Reads as many boards as fit in scanBudget, starting where the previous call stopped.
+// Boards that weren't read keep their previous reading.
+BassReadings& __not_in_flash_func(pollBoards)() {
+  PROFILE_SECTION(PollBoards);
+  deadline::Timer t(deadline::Poll);
+  BassReadings& result = lastReadings;
+  elapsedMicros sinceStart;
+  for (int i = 0; i < boardCount; i++) {
+    int b = nextBoard;
+    bassboard::Reading& r = result.reading[b];
+    r = boards[b].poll();
+    if (i == 0) result.pollTime = r.pollTime;
+    for (int e = 0; e < r.edgeCount; e++) {
+      if ((long)(r.edges[e].time - result.pollTime) < 0) {
+        result.pollTime = r.edges[e].time;
+      }
+    }
+    nextBoard = (b + 1) % boardCount;
+    if (sinceStart >= scanBudget) break;
+  }
 
-BassReadings pollBoards() {
-  BassReadings result;
-  result.chord = music::Chord();
-  result.bass = music::Chord();
-  bool allValid = true;
-  for (int b = 0; b < boardCount; b++) {
-    result.reading[b] = boards[b].poll();
-    result.chord = result.chord + result.reading[b].chord;
-    result.bass = result.bass + result.reading[b].bass;
-    if (!result.reading[b].valid) {
-      allValid = false;
+  // Take one step of reconnecting at most one offline board per frame, if there's time.
+  for (int i = 0; i < boardCount && sinceStart < scanBudget; i++) {
+    int b = nextProbe;
+    nextProbe = (nextProbe + 1) % boardCount;
+    if (boards[b].probeDue()) {
+      boards[b].probe();
+      break;
     }
   }
-  if (allValid) {
-    sinceValidRead = 0;
+
+  for (int o = 0; o < layout::outputCount; o++) {
+    result.notes[o] = music::Chord();
+    for (int b = 0; b < boardCount; b++) {
+      result.notes[o] = result.notes[o] + result.reading[b].notes[o];
+    }
   }
   return result;
 }
 
+// Time from taking a sample or reading the buttons to sending the MIDI message.
+latency::Histogram bellowsLatency("bellows");
+latency::Histogram noteLatency("notes");
+
+// Runs the microbenchmarks and prints the results.
+// Inputs and state are static, since together they'd take much of core 0's 2 KB stack.
+void runBenchmarks() {
+  bench::Runner runner(Serial, bench::budgets, bench::budgetCount);
+  sensor::runBenchmarks(runner);
+  bench::runCalibration(runner);
+
+  // calculateLaps keeps state between calls, so put it back afterwards.
+  float savedPressure = pressure;
+  float savedLaps = prevAdjustedLaps;
+  static sensor::Report report;
+  report.duration = referenceDuration;
+  runner.run("calculateLaps", 1000, [&](int i) {
+    report.last.theta = (i * 13) % sensor::ticksPerTurn;
+    bench::keep(calculateLaps(report).midiValue);
+  });
+  pressure = savedPressure;
+  prevAdjustedLaps = savedLaps;
+
+  bench::runButtons(runner, bus0);
+  bench::runOutput(runner);
+  runner.finish();
+}
+
+sensor::Report buffer;
+sensor::Report* current = &buffer;
+
+// Handles single-character commands sent over serial.
+void handleCommand() {
+  switch (Serial.read()) {
+    case 'l':
+      bellowsLatency.printTo(Serial);
+      noteLatency.printTo(Serial);
+      break;
+    case 'L':
+      bellowsLatency.clear();
+      noteLatency.clear();
+      break;
+    case 'p':
+      profile::printTo(Serial);
+      break;
+    case 'P':
+      profile::clear();
+      break;
+    case 'm':
+      busperf::printTo(Serial);
+      break;
+    case 'b':
+      for (int b = 0; b < boardCount; b++) {
+        Serial.print(boards[b].name); Serial.print(boards[b].ready ? ": " : " (offline): ");
+        boards[b].stats.printTo(Serial);
+        Serial.print("  ");
+        boards[b].health.printTo(Serial);
+      }
+      for (int i = 0; i < busCount; i++) {
+        Serial.print("bus"); Serial.print(i); Serial.print(": recoveries=");
+        Serial.println(buses[i]->recoveries);
+      }
+      break;
+    case 'B':
+      for (int b = 0; b < boardCount; b++) {
+        boards[b].stats.clear();
+      }
+      break;
+    case 'k':
+      layout::printTo(Serial);
+      break;
+    case 'x':
+      runBenchmarks();
+      break;
+    case 'c':
+      Serial.print("treble: "); trebleChannel.stats.printTo(Serial);
+      Serial.print("chord: "); chordChannel.stats.printTo(Serial);
+      Serial.print("bass: "); bassChannel.stats.printTo(Serial);
+      break;
+    case 'C':
+      trebleChannel.stats.clear();
+      chordChannel.stats.clear();
+      bassChannel.stats.clear();
+      break;
+    case 'i':
+      boot::printTo(Serial);
+      Serial.print("warmupReads="); Serial.print(sensor::warmup.reads);
+      Serial.println(sensor::warmup.settled ? "" : " (didn't settle)");
+      break;
+    case 'n':
+      Serial.print("midi in: "); midiIn::stats.printTo(Serial);
+      midiIn::clock.printTo(Serial);
+      break;
+    case 'N':
+      midiIn::stats = {};
+      break;
+    case 'o':
+      deadline::printTo(Serial);
+      break;
+    case 'O':
+      deadline::clear();
+      break;
+    case 's':
+      Serial.print("speed="); Serial.print(current->speed);
+      Serial.print(" maxSafeSpeed="); Serial.print(sensor::maxSafeSpeed(current->samplePeriod));
+      Serial.print(" ticks/s jumps="); Serial.println(current->jumps);
+      break;
+  }
+}
+
+// Starts using the active layout.
+void applyLayout() {
+  layout::Layout* l = layout::active;
+  for (int b = 0; b < boardCount; b++) {
+    boards[b].setRoutes(&l->routes[b]);
+  }
+  trebleChannel.setChannel(l->channel[layout::treble]);
+  chordChannel.setChannel(l->channel[layout::chord]);
+  bassChannel.setChannel(l->channel[layout::bass]);
+}
+
+// Sets up the active layout using the default layers.
+void beginLayout() {
+  static_assert(boardCount <= layout::maxBoards, "too many boards for layout");
+  layout::Layout* l = layout::active;
+  for (int i = 0; i < defaultLayerCount; i++) {
+    l->layers[i] = defaultLayers[i];
+  }
+  l->layerCount = defaultLayerCount;
+  l->bottomBass = bassmaps::bottomBass.toMidiNumber();
+  l->channel[layout::treble] = 1;
+  l->channel[layout::chord] = 2;
+  l->channel[layout::bass] = 3;
+  for (int out = 0; out < layout::outputCount; out++) {
+    layout::setDefaultVelocities(*l, (layout::Output)out);
+  }
+  layout::begin(boardCount);
+  applyLayout();
+}
+
+// Switches to a preset. The scan carries on with the old one until the next frame, and if
+// several arrive before then, the last one is used.
+void handleProgramChange(midi::Channel chan, midi::DataByte program) {
+  if (program >= presetCount || !layout::loadLayers(presets[program].layers, presets[program].layerCount)) {
+    midiIn::stats.rejected++;
+  }
+}
+
+// After the host turns off all notes on a channel, held buttons play again.
+void handleControlChange(midi::Channel chan, midi::DataByte control, midi::DataByte value) {
+  const int allNotesOff = 123;
+  if (control != allNotesOff) {
+    midiIn::stats.ignored++;
+    return;
+  }
+  if (trebleChannel.channel() == chan) trebleChannel.forgetNotes();
+  if (chordChannel.channel() == chan) chordChannel.forgetNotes();
+  if (bassChannel.channel() == chan) bassChannel.forgetNotes();
+}
+
+// The host has reset its state, so send everything again.
+void handleSystemReset() {
+  trebleChannel.forgetNotes();
+  chordChannel.forgetNotes();
+  bassChannel.forgetNotes();
+  trebleChannel.forgetControlValues();
+  chordChannel.forgetControlValues();
+  bassChannel.forgetControlValues();
+}
+
+// Reads incoming MIDI messages, such as layout changes, within midiIn::readBudget.
+void readMidi() {
+  midiIn::read(midiOut::MID);
+}
+
 bool logging = false;
+bool mounted = false; // whether USB was mounted at the start of this frame
+
+// Resets the board if loop() stops getting sensor reports, which happens if either core
+// hangs. Long enough for setup and the sensor warmup.
+const uint32_t watchdogTimeout = 500; // milliseconds
 
+// Set after a watchdog reset, until the host has been told to release any stuck notes.
+bool notesOffPending = false;
+
+// Once USB is back, turns off any notes left on from before the reset.
+void sendPendingNotesOff() {
+  if (!notesOffPending || !TinyUSBDevice.mounted()) {
+    return;
+  }
+  trebleChannel.sendAllNotesOff();
+  chordChannel.sendAllNotesOff();
+  bassChannel.sendAllNotesOff();
+  notesOffPending = false;
+}
+
+// Starts the slow things first: USB enumeration runs in the background, and core 1 warms
+// up the sensor while this core reaches the boards.
 void setup() {
   midiOut::begin();
+  boot::mark(boot::UsbStarted);
   sensor::begin();
+  boot::mark(boot::SensorPowered);
+
+  midiOut::MID.setHandleSystemExclusive(layout::handleSysEx);
+  midiOut::MID.setHandleProgramChange(handleProgramChange);
+  midiOut::MID.setHandleControlChange(handleControlChange);
+  midiOut::MID.setHandleSystemReset(handleSystemReset);
+  midiIn::begin(midiOut::MID);
+  trebleChannel.setCoalesceWindow(coalesceWindow);
+  chordChannel.setCoalesceWindow(coalesceWindow);
+  bassChannel.setCoalesceWindow(coalesceWindow);
+  busperf::begin();
+  beginLayout();
 
-  Wire.setSDA(dataPin);
-  Wire.setSCL(clockPin);
-  Wire.setTimeout(50);
   pinMode(powerPin, OUTPUT);
   digitalWrite(powerPin, HIGH);
+  for (int i = 0; i < busCount; i++) {
+    buses[i]->begin(i2cTimeout);
+  }
 
+  // Boards that don't answer yet are retried from loop(), so this doesn't wait for them.
   for (int b = 0; b < boardCount; b++) {
     boards[b].begin();
   }
-}
+  boot::mark(boot::BoardsStarted);
 
-sensor::Report buffer;
-sensor::Report* current = &buffer;
+  notesOffPending = watchdog_caused_reboot();
+  rp2040.wdt_begin(watchdogTimeout);
+  boot::mark(boot::SetupDone);
+}
 
 void loop() {
-  if (!logging && Serial && Serial.dtr()) {
-    printHeader();
+  {
+    deadline::Timer t(deadline::Logging);
+    if (!logging && Serial && Serial.dtr()) {
+      printHeader();
+    }
+    logging = Serial.dtr();
+    if (Serial.available()) {
+      handleCommand();
+    }
+  }
+
+  {
+    deadline::Timer t(deadline::Midi);
+    // Switch layouts between frames, never during a scan.
+    bool committed;
+    if (layout::takeSwap(committed)) {
+      applyLayout();
+      if (committed) {
+        midiOut::MID.sendSysEx(sizeof(layout::ackMessage), layout::ackMessage, true);
+      }
+    }
+    readMidi();
+    mounted = TinyUSBDevice.mounted();
+    if (boot::checkUsb(mounted)) {
+      // The host may have lost the bellows position, so send it again.
+      trebleChannel.forgetControlValues();
+      chordChannel.forgetControlValues();
+      bassChannel.forgetControlValues();
+    }
+    sendPendingNotesOff();
   }
-  logging = Serial.dtr();
 
+  deadline::endFrame();
   current = sensor::takeReport(current);
-  LapMetrics lm = calculateLaps(current->last);
-  trebleChannel.sendControlChange(bellowsControl, lm.midiValue);
-  chordChannel.sendControlChange(bellowsControl, lm.midiValue);
-  bassChannel.sendControlChange(bellowsControl, lm.midiValue);
-  calibration::WeightMetrics wm = calibration::adjustWeights(lm.laps);
+  // A new report means core 1 is still sampling, and this core is still looping.
+  rp2040.wdt_reset();
+  deadline::startFrame(current->duration);
+  boot::mark(boot::SensorWarm, sensor::warmup.doneTime);
+  boot::mark(boot::FirstReport);
+
+  LapMetrics lm;
+  {
+    deadline::Timer t(deadline::Calibration);
+    lm = calculateLaps(*current);
+  }
+  {
+    deadline::Timer t(deadline::Midi);
+    bool bellowsSent = trebleChannel.sendControlChange(bellowsControl, lm.midiValue);
+    bellowsSent = chordChannel.sendControlChange(bellowsControl, lm.midiValue) || bellowsSent;
+    bellowsSent = bassChannel.sendControlChange(bellowsControl, lm.midiValue) || bellowsSent;
+    if (bellowsSent) {
+      bellowsLatency.add(micros() - current->last.sampleTime);
+      if (mounted) boot::mark(boot::FirstControl);
+    }
+  }
+  calibration::WeightMetrics wm;
+  {
+    deadline::Timer t(deadline::Calibration);
+    wm = calibration::adjustWeights(lm.laps, current->duration);
+  }
 
-  BassReadings readings = pollBoards();
-  bool noteChanged = chordChannel.sendChord(readings.chord) || bassChannel.sendChord(readings.bass);
+  BassReadings& readings = pollBoards();
+
+  bool noteChanged;
+  {
+    deadline::Timer t(deadline::Midi);
+    sendAnalogControls(*current);
+    // Send every output even if an earlier one changed.
+    bool trebleChanged;
+    {
+      PROFILE_SECTION(SendTreble);
+      trebleChanged = trebleChannel.sendChord(readings.notes[layout::treble]);
+    }
+    bool chordChanged;
+    {
+      PROFILE_SECTION(SendChord);
+      chordChanged = chordChannel.sendChord(readings.notes[layout::chord]);
+    }
+    bool bassChanged;
+    {
+      PROFILE_SECTION(SendBass);
+      bassChanged = bassChannel.sendChord(readings.notes[layout::bass]);
+    }
+    noteChanged = trebleChanged || chordChanged || bassChanged;
+    if (noteChanged) {
+      // A change held for coalescing was first seen that much before this frame's poll.
+      unsigned long held = 0;
+      if (trebleChanged && trebleChannel.lastHold > held) held = trebleChannel.lastHold;
+      if (chordChanged && chordChannel.lastHold > held) held = chordChannel.lastHold;
+      if (bassChanged && bassChannel.lastHold > held) held = bassChannel.lastHold;
+      noteLatency.add(micros() - readings.pollTime + held);
+      if (mounted) boot::mark(boot::FirstNote);
+    }
+  }
 
   if (logging) {
+    deadline::Timer t(deadline::Logging);
     printLine(lm, wm, *current, readings);
 
     if (noteChanged) {
       Serial.print("# ");
-      readings.chord.printTo(Serial);
+      readings.notes[layout::chord].printTo(Serial);
       Serial.println();
       Serial.flush();
     }
@@ -209,6 +627,5 @@ void loop() {
 }
 
 void loop1() {
-  delay(100);
   sensor::runReadLoop();
 }
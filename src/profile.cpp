@@ -0,0 +1,77 @@
+#ifdef ARDUINO_ARCH_RP2040
+#include <Arduino.h>
+#else
+#include <chrono>
+#define __not_in_flash_func(f) f
+#endif
+
+#include "profile.h"
+
+namespace profile {
+
+static const char* const sectionNames[sectionCount] = {
+  "readAndCalculate",
+  "calculatePhase",
+  "countLaps",
+  "calculateLaps",
+  "adjustWeights",
+  "adjustLaps",
+  "pollBoards",
+  "sendTreble",
+  "sendChord",
+  "sendBass",
+};
+
+Stats stats[coreCount][sectionCount];
+
+uint32_t __not_in_flash_func(now)() {
+#ifdef ARDUINO_ARCH_RP2040
+  return rp2040.getCycleCount();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+static int __not_in_flash_func(currentCore)() {
+#ifdef ARDUINO_ARCH_RP2040
+  return get_core_num();
+#else
+  return 0;
+#endif
+}
+
+void __not_in_flash_func(record)(Section section, uint32_t elapsed) {
+  Stats& s = stats[currentCore()][section];
+  s.count++;
+  s.total += elapsed;
+  if (elapsed > s.max) s.max = elapsed;
+}
+
+void clear() {
+  for (int c = 0; c < coreCount; c++) {
+    for (int i = 0; i < sectionCount; i++) {
+      stats[c][i] = Stats{0, 0, 0};
+    }
+  }
+}
+
+void printTo(Print& out) {
+#ifndef PROFILE
+  out.println("# profiling disabled (build with -DPROFILE)");
+#endif
+  for (int c = 0; c < coreCount; c++) {
+    for (int i = 0; i < sectionCount; i++) {
+      Stats s = stats[c][i];
+      if (s.count == 0) continue;
+      out.print("core"); out.print(c); out.print(" ");
+      out.print(sectionNames[i]);
+      out.print(": count="); out.print(s.count);
+      out.print(" avg="); out.print((uint32_t)(s.total / s.count));
+      out.print(" max="); out.print(s.max);
+      out.print(" total="); out.println(s.total);
+    }
+  }
+}
+
+} // profile
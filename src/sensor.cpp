@@ -1,11 +1,43 @@
+#include <hardware/adc.h>
+
 #include "sensor.h"
+#include "ellipse.h"
+#include "laps.h"
 #include "pins.h"
+#include "placement.h"
+#include "profile.h"
+#include "bench.h"
+#include "sensor_benchmarks.h"
 
 namespace sensor {
 
-// times in microseconds
-const int samplePeriod = 1000;
-const int samplesPerReport = 5;
+// How often to sample and report. Times are in microseconds.
+struct Rate {
+  int samplePeriod;
+  int samplesPerReport;
+};
+
+const Rate restRate = { 2000, 3 };   // a report every 6 ms
+const Rate normalRate = { 1000, 5 }; // a report every 5 ms
+const Rate fastRate = { 500, 4 };    // a report every 2 ms
+
+// When true, the rate follows the bellows speed. Otherwise it's always normalRate.
+const bool adaptiveRate = true;
+
+// Speeds for changing rate, in ticks per second. Each pair has a gap between them,
+// so that the rate doesn't flip back and forth around one speed.
+const int restBelow = ticksPerTurn / 20;
+const int restAbove = ticksPerTurn / 10;
+const int fastAbove = ticksPerTurn;
+const int fastBelow = ticksPerTurn / 2;
+
+const AnalogChannel analogChannels[] = {
+  // Switch to ControlChange once a pedal is connected; an open input reads noise.
+  { "pedal", expressionPin, 5, 3, Raw, 11 }, // 11 is expression
+};
+
+const int analogChannelCount = sizeof(analogChannels) / sizeof(analogChannels[0]);
+static_assert(analogChannelCount <= maxAnalogChannels, "too many analog channels");
 
 // Messages for multi-core fifo.
 // See: https://arduino-pico.readthedocs.io/en/latest/multicore.html#communicating-between-cores
@@ -13,13 +45,27 @@ enum { READY, SENT };
 
 static Report* dest = 0;
 
-static Report buffer1;
+static Report buffer1; // handed to core 0, so not in scratch X
+
+// Set by begin() once the sensor is powered and the ADC is ready.
+static volatile bool powered = false;
+static unsigned long poweredTime; // micros(), written before powered is set
 
 void begin() {
   dest = &buffer1;
   rp2040.fifo.push(READY);
   pinMode(powerPin, OUTPUT);
   digitalWrite(powerPin, HIGH);
+
+  // Read the ADC directly rather than with analogRead, which runs from flash.
+  adc_init();
+  adc_gpio_init(aSensorPin);
+  adc_gpio_init(bSensorPin);
+  for (int i = 0; i < analogChannelCount; i++) {
+    adc_gpio_init(analogChannels[i].pin);
+  }
+  poweredTime = micros();
+  powered = true;
 }
 
 Report* __not_in_flash_func(takeReport)(Report* nextDest) {
@@ -33,7 +79,7 @@ Report* __not_in_flash_func(takeReport)(Report* nextDest) {
   return result;
 }
 
-static Report* __not_in_flash_func(sendReport)(Report* response) {
+static Report* CORE1_FUNC(sendReport)(Report* response) {
   elapsedMicros sinceStart;
 
   while (rp2040.fifo.pop() != READY) {}
@@ -48,19 +94,24 @@ static Report* __not_in_flash_func(sendReport)(Report* response) {
   return next;
 }
 
-static void __not_in_flash_func(takeReading)(Reading& out) {
+// The ADC is 12 bits, but the calculations below expect analogRead's default of 10.
+const int adcShift = 2;
+
+static void CORE1_FUNC(takeReading)(Reading& out) {
   elapsedMicros now = 0;
 
-  out.a = analogRead(aSensorPin);
+  adc_select_input(aSensorPin - A0);
+  out.a = adc_read() >> adcShift;
   out.aReadTime = now;
 
-  out.b = analogRead(bSensorPin);
+  adc_select_input(bSensorPin - A0);
+  out.b = adc_read() >> adcShift;
   out.bReadTime = now - out.aReadTime;
 }
 
-elapsedMicros now;
+CORE1_DATA elapsedMicros now;
 
-static void __not_in_flash_func(takeTimedReading)(int nextReadTime, Reading& out) {
+static void CORE1_FUNC(takeTimedReading)(int nextReadTime, Reading& out) {
   rp2040.idleOtherCore();
   takeReading(out); // warmup
 
@@ -72,17 +123,14 @@ static void __not_in_flash_func(takeTimedReading)(int nextReadTime, Reading& out
   }
   while (jitter < 0);
 
+  out.sampleTime = micros();
   takeReading(out);
   out.jitter = jitter;
   rp2040.resumeOtherCore();
   out.totalReadTime = ((long)now) - readStart;
 }
 
-const int halfTurn = ticksPerTurn/2;
-const int quarterTurn = ticksPerTurn/4;
-const int eighthTurn = ticksPerTurn/8;
-
-static int __not_in_flash_func(approximatePhase)(int x, int y) {
+static int CORE1_FUNC(approximatePhase)(int x, int y) {
   // A very rough approximation of atan2. It will be adjusted via calibration later so it shouldn't matter.
   if (x >= abs(y)) {
     return (eighthTurn * y)/x;
@@ -95,38 +143,59 @@ static int __not_in_flash_func(approximatePhase)(int x, int y) {
   }
 }
 
-int laps = 0;
-int prevTheta = 0;
-
-static void __not_in_flash_func(countLaps)(Report &rep) {
-  int thetaChange = rep.last.theta - prevTheta;
-  if (thetaChange < -halfTurn) {
-    laps++;
-    thetaChange += ticksPerTurn;
-  } else if (thetaChange > halfTurn) {
-    laps--;
-    thetaChange -= ticksPerTurn;
-  }
-  rep.last.laps = laps;
-  prevTheta = rep.last.theta;
-  rep.thetaChange += thetaChange;
-}
-
-static int __not_in_flash_func(calculatePhase)(int x, int y) {
+static int CORE1_FUNC(calculatePhase)(int x, int y) {
+  PROFILE_SECTION(CalculatePhase);
   int theta = approximatePhase(x, y);
   if (theta < 0) theta += ticksPerTurn;
   return theta;
 }
 
-elapsedMicros sinceIdle;
+CORE1_DATA LapCounter lapCounter;
+CORE1_DATA elapsedMicros sinceIdle;
+CORE1_DATA EllipseFit fit;
+
+CORE1_DATA int analogFiltered[maxAnalogChannels]; // scaled up by 16
+CORE1_DATA int analogWait[maxAnalogChannels];     // sample periods until the next read
+
+// Reads at most one analog channel that's due, after the bellows reading.
+static void CORE1_FUNC(readAnalogChannels)(long nextReadTime, Report& rep) {
+  bool done = false;
+  for (int i = 0; i < analogChannelCount; i++) {
+    const AnalogChannel& ch = analogChannels[i];
+    AnalogReading& out = rep.analog[i];
+    analogWait[i]--;
+    if (!done && analogWait[i] <= 0) {
+      long start = now;
+      adc_select_input(ch.pin - A0);
+      int raw = adc_read() >> adcShift;
+      int readTime = ((long)now) - start;
+      int jitter = start - nextReadTime;
+
+      analogFiltered[i] += ((raw << 4) - analogFiltered[i]) >> ch.smoothing;
+      analogWait[i] = ch.divider;
+      out.reads++;
+      if (jitter > out.maxJitter) out.maxJitter = jitter;
+      if (readTime > out.maxReadTime) out.maxReadTime = readTime;
+      done = true;
+    }
+    out.value = analogFiltered[i] >> 4;
+  }
+}
 
-static void __not_in_flash_func(readAndCalculate)(long nextReadTime, Report& rep) {
+static void CORE1_FUNC(readAndCalculate)(long nextReadTime, Report& rep) {
   while (((long)now) - nextReadTime < -110) {}
   int idle = sinceIdle;
   takeTimedReading(nextReadTime, rep.last);
-
-  rep.last.theta = calculatePhase(rep.last.a - 300, rep.last.b - 300);
-  countLaps(rep);
+  // Starts after the timed read, which waits for the read time.
+  PROFILE_SECTION(ReadAndCalculate);
+  readAnalogChannels(nextReadTime, rep);
+
+  fit.add(rep.last.a, rep.last.b);
+  int x, y;
+  fit.correct(rep.last.a, rep.last.b, x, y);
+  rep.last.theta = calculatePhase(x, y);
+  rep.ellipse = fit.params();
+  countLaps(lapCounter, rep);
   rep.samples++;
 
   if (rep.last.jitter > rep.maxJitter) rep.maxJitter = rep.last.jitter;
@@ -135,32 +204,118 @@ static void __not_in_flash_func(readAndCalculate)(long nextReadTime, Report& rep
   sinceIdle = 0;
 }
 
-static Report buffer2;
+static Report buffer2; // handed to core 0, so not in scratch X
 
-void __not_in_flash_func(runReadLoop)() {
+// Picks the rate for the next report, based on how fast the bellows moved in this one.
+static const Rate* CORE1_FUNC(chooseRate)(const Rate* rate, Report& rep) {
+  int speed = (int64_t)abs(rep.thetaChange) * 1000000 / rep.duration;
+  if (rate == &fastRate) {
+    return speed < fastBelow ? &normalRate : rate;
+  } else if (rate == &restRate) {
+    return speed > restAbove ? &normalRate : rate;
+  }
+  if (speed > fastAbove) return &fastRate;
+  if (speed < restBelow) return &restRate;
+  return rate;
+}
 
-  // warmup
-  Reading r;
+// Warmup reads until the sensor has settled: this many in a row within settleTolerance
+// of the one before. Reads are warmupInterval apart, so that a slow drift shows up as
+// a difference, and start no sooner than minWarmup after power on. Gives up waiting
+// after maxWarmupReads.
+const int settledReads = 3;
+const int settleTolerance = 4;
+const int maxWarmupReads = 200;
+const unsigned long minWarmup = 2000;     // microseconds after power on
+const unsigned long warmupInterval = 1000; // microseconds between reads
+
+Warmup warmup;
+
+static void takeWarmupReading(Reading& r, unsigned long at) {
+  while ((long)(micros() - at) < 0) {}
+  // Only pause core 0 during each read, so that it can carry on starting up.
   rp2040.idleOtherCore();
-  for (int i =0; i <10; i++) {
-    sensor::takeReading(r);
-  }
+  takeReading(r);
   rp2040.resumeOtherCore();
-  prevTheta = calculatePhase(r.a - 300, r.b - 300);
+}
+
+// Runs once at startup, so it stays in flash rather than taking up scratch X.
+static int warmUp(Reading& r) {
+  Reading prev;
+  unsigned long readTime = poweredTime + minWarmup;
+  takeWarmupReading(prev, readTime);
+  int steady = 0;
+  int reads = 1;
+  while (steady < settledReads && reads < maxWarmupReads) {
+    readTime += warmupInterval;
+    takeWarmupReading(r, readTime);
+    reads++;
+    bool close = abs(r.a - prev.a) <= settleTolerance && abs(r.b - prev.b) <= settleTolerance;
+    steady = close ? steady + 1 : 0;
+    prev = r;
+  }
+  warmup.settled = steady >= settledReads;
+  return reads;
+}
+
+void CORE1_FUNC(runReadLoop)() {
+  while (!powered) {}
+
+  Reading r;
+  warmup.reads = warmUp(r);
+  warmup.doneTime = micros();
+  for (int i = 0; i < analogChannelCount; i++) {
+    adc_select_input(analogChannels[i].pin - A0);
+    analogFiltered[i] = (adc_read() >> adcShift) << 4;
+  }
+  int x, y;
+  fit.correct(r.a, r.b, x, y);
+  lapCounter.prevTheta = calculatePhase(x, y);
+  lapCounter.prevTime = micros();
 
   // take readings at fixed intervals
   now = -1000;
   long nextReadTime = 0;
 
+  const Rate* rate = &normalRate;
   Report* rep = &buffer2;
   rep->clear();
   while (true) {
-    while(rep->samples < samplesPerReport) {
+    while(rep->samples < rate->samplesPerReport) {
       readAndCalculate(nextReadTime, *rep);
-      nextReadTime += samplePeriod;
+      nextReadTime += rate->samplePeriod;
+    }
+    rep->samplePeriod = rate->samplePeriod;
+    rep->duration = rep->samples * rate->samplePeriod;
+    if (adaptiveRate) {
+      rate = chooseRate(rate, *rep);
     }
     rep = sendReport(rep);
   }
 }
 
+// Benchmarks the sensor calculations using separate state, so it can run on core 0
+// while core 1 is sampling.
+// Static, to keep them off the stack of the core running the benchmarks.
+void runBenchmarks(bench::Runner& runner) {
+  const int inputCount = 64;
+  static int xs[inputCount];
+  static int ys[inputCount];
+  for (int i = 0; i < inputCount; i++) {
+    float angle = i * 2 * M_PI / inputCount;
+    xs[i] = cosf(angle) * unitRadius;
+    ys[i] = sinf(angle) * unitRadius;
+  }
+
+  runner.run("approximatePhase", 1000, [&](int i) {
+    bench::keep(approximatePhase(xs[i % inputCount], ys[i % inputCount]));
+  });
+
+  runner.run("calculatePhase", 1000, [&](int i) {
+    bench::keep(calculatePhase(xs[i % inputCount], ys[i % inputCount]));
+  });
+
+  runTrackingBenchmarks(runner);
+}
+
 } // sensor
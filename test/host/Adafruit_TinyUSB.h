@@ -0,0 +1,13 @@
+#ifndef HOST_ADAFRUIT_TINYUSB_H
+#define HOST_ADAFRUIT_TINYUSB_H
+
+#include "Arduino.h"
+
+// A USB MIDI port that's never connected, so midi_out.h builds on the host.
+class Adafruit_USBD_MIDI : public Stream {
+public:
+  void begin(unsigned long) {}
+  size_t write(uint8_t) override { return 1; }
+};
+
+#endif // HOST_ADAFRUIT_TINYUSB_H
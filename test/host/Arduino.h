@@ -0,0 +1,78 @@
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "Print.h"
+#include "Stream.h"
+
+// A stand-in for the Arduino core, so the headers in include/ can be unit tested on the
+// host (pio test -e native). Time only moves when a test moves it, and pins are simulated
+// well enough to test recovering a stuck i2c bus.
+
+#define __not_in_flash_func(f) f
+#define __not_in_flash(group)
+#define __scratch_x(group)
+#define __scratch_y(group)
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+typedef uint8_t byte;
+
+namespace host {
+
+unsigned long time = 0; // micros()
+
+// A device holding a pin low, as if stuck partway through a transfer. It lets go after
+// releaseAfter clock pulses, which are counted whenever another pin is driven low.
+int heldPin = -1;
+int releaseAfter = 0;
+
+void advance(unsigned long us) {
+  time += us;
+}
+
+} // host
+
+inline unsigned long micros() { return host::time; }
+inline unsigned long millis() { return host::time / 1000; }
+inline void delayMicroseconds(unsigned int us) { host::advance(us); }
+inline void delay(unsigned long ms) { host::advance(ms * 1000); }
+
+inline void pinMode(int pin, int mode) {
+  if (mode == OUTPUT && pin != host::heldPin && host::heldPin >= 0 && --host::releaseAfter <= 0) {
+    host::heldPin = -1;
+  }
+}
+
+inline void digitalWrite(int, int) {}
+
+inline int digitalRead(int pin) {
+  return pin == host::heldPin ? LOW : HIGH;
+}
+
+// Serial output is thrown away.
+class HostSerial : public Stream {
+public:
+  size_t write(uint8_t) override { return 1; }
+};
+
+HostSerial Serial;
+
+// A UART with nothing attached, for DIN MIDI.
+class SerialUART : public Stream {
+public:
+  void begin(unsigned long) {}
+  size_t write(uint8_t) override { return 1; }
+};
+
+SerialUART Serial1;
+
+#endif // HOST_ARDUINO_H
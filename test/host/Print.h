@@ -0,0 +1,47 @@
+#ifndef HOST_PRINT_H
+#define HOST_PRINT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+
+// Just enough of Arduino's Print to build the headers on the host.
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+
+  size_t print(const char* s) {
+    size_t n = 0;
+    while (*s) n += write(*s++);
+    return n;
+  }
+
+  size_t print(char c) { return write(c); }
+
+  template<class T> size_t print(T value) {
+    return print(std::to_string(value).c_str());
+  }
+
+  size_t print(double value, int digits) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.*f", digits, value);
+    return print((const char*)buf);
+  }
+
+  size_t println() { return print("\r\n"); }
+
+  template<class T> size_t println(T value) {
+    return print(value) + println();
+  }
+
+  size_t println(double value, int digits) {
+    return print(value, digits) + println();
+  }
+
+  virtual void flush() {}
+};
+
+#endif // HOST_PRINT_H
@@ -0,0 +1,125 @@
+#ifndef HOST_WIRE_H
+#define HOST_WIRE_H
+
+#include <Arduino.h>
+
+// The part of TwoWire that bassboard uses, as a simulated bus of MCP23017s for host tests.
+// Tests can unplug devices, make transfers fail, or hold SDA low (see host::heldPin).
+// Transfers take as long as they would at the bus clock, and a stuck bus costs the timeout.
+
+struct SimDevice {
+  bool present = false;
+  uint8_t regs[0x16] = {};
+  uint8_t pointer = 0;
+  uint32_t transfers = 0;
+
+  // Sets the pins, as read from PortA and PortB. A bit is 0 while its button is down.
+  void setPins(uint16_t bits) {
+    regs[0x12] = bits & 0xff;
+    regs[0x13] = bits >> 8;
+  }
+
+  void advancePointer() {
+    if (regs[0x0A] & 0x20) {
+      pointer ^= 1; // byte mode: stays on the same pair of registers
+    } else {
+      pointer = (pointer + 1) % sizeof(regs);
+    }
+  }
+};
+
+class TwoWire : public Stream {
+public:
+  static const int firstAddress = 0x20;
+  SimDevice devices[8]; // by address, from firstAddress
+  int failTransfers = 0; // the next this many transfers fail, whatever the address
+  uint32_t transfers = 0;
+
+  void setSDA(int pin) { sdaPin = pin; }
+  void setSCL(int) {}
+  void setClock(uint32_t hz) { clock = hz; }
+  void setTimeout(int ms) { timeoutMillis = ms; }
+  void begin() {}
+  void end() {}
+
+  void beginTransmission(int addr) {
+    txAddr = addr;
+    txCount = 0;
+  }
+
+  size_t write(uint8_t b) override {
+    if (txCount < sizeof(tx)) tx[txCount++] = b;
+    return 1;
+  }
+
+  // Returns 0 if successful, 2 if the address wasn't acknowledged or 5 on a timeout.
+  uint8_t endTransmission(bool = true) {
+    int err = 0;
+    SimDevice* d = start(txAddr, txCount, err);
+    if (!d) return err;
+    for (size_t i = 0; i < txCount; i++) {
+      if (i == 0) {
+        d->pointer = tx[0];
+      } else {
+        d->regs[d->pointer] = tx[i];
+        d->advancePointer();
+      }
+    }
+    return 0;
+  }
+
+  size_t requestFrom(int addr, size_t count, bool = true) {
+    rxCount = 0;
+    rxNext = 0;
+    int err = 0;
+    SimDevice* d = start(addr, count, err);
+    if (!d) return 0;
+    for (size_t i = 0; i < count && i < sizeof(rx); i++) {
+      rx[rxCount++] = d->regs[d->pointer];
+      d->advancePointer();
+    }
+    return rxCount;
+  }
+
+  int available() override { return rxCount - rxNext; }
+  int read() override { return rxNext < rxCount ? rx[rxNext++] : -1; }
+
+private:
+  int sdaPin = -1;
+  uint32_t clock = 100000;
+  int timeoutMillis = 25;
+
+  int txAddr = 0;
+  uint8_t tx[8];
+  size_t txCount = 0;
+  uint8_t rx[8];
+  size_t rxCount = 0;
+  size_t rxNext = 0;
+
+  // Starts a transfer of some bytes after the address, charging the time it takes.
+  // Returns the device, or null with the error if the transfer fails.
+  SimDevice* start(int addr, size_t bytes, int& err) {
+    transfers++;
+    if (sdaPin >= 0 && host::heldPin == sdaPin) {
+      host::advance(timeoutMillis * 1000UL);
+      err = 5;
+      return nullptr;
+    }
+    int i = addr - firstAddress;
+    bool answers = i >= 0 && i < 8 && devices[i].present && failTransfers == 0;
+    if (failTransfers > 0) failTransfers--;
+    // Address and data bytes are 9 clocks each, with the ack. A missing device only
+    // costs the address.
+    host::advance(((answers ? bytes : 0) + 1) * 9 * 1000000UL / clock);
+    if (!answers) {
+      err = 2;
+      return nullptr;
+    }
+    devices[i].transfers++;
+    return &devices[i];
+  }
+};
+
+TwoWire Wire;
+
+#endif // HOST_WIRE_H
@@ -0,0 +1,10 @@
+#ifndef HOST_HARDWARE_GPIO_H
+#define HOST_HARDWARE_GPIO_H
+
+#include <Arduino.h>
+
+inline bool gpio_get(unsigned pin) {
+  return digitalRead(pin) == HIGH;
+}
+
+#endif // HOST_HARDWARE_GPIO_H
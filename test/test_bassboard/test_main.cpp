@@ -0,0 +1,221 @@
+#include <unity.h>
+
+#include "bassboard.h"
+
+// Board against a simulated bus (test/host/Wire.h) that can drop devices, fail transfers
+// and get stuck.
+
+using namespace bassboard;
+
+const int sdaPin = 4;
+const int sclPin = 5;
+const uint16_t allUp = 0xffff;
+
+Bus bus(Wire, sdaPin, sclPin, 400000);
+
+SimDevice& device() {
+  return Wire.devices[0];
+}
+
+void setUp() {
+  host::time = 0;
+  host::heldPin = -1;
+  Wire = TwoWire();
+  device().present = true;
+  device().setPins(allUp);
+  bus.begin(1);
+}
+
+void tearDown() {}
+
+// Polls until the board goes offline, returning the reading that took it offline.
+Reading pollUntilOffline(Board& board) {
+  Reading r = {};
+  for (int i = 0; i < maxErrors && board.ready; i++) {
+    host::advance(1000);
+    r = board.poll();
+  }
+  return r;
+}
+
+// Most transfers done by one call to probe() in probeUntilDone.
+uint32_t mostTransfers;
+
+// Probes until the board is back or an attempt fails. Returns the number of calls.
+int probeUntilDone(Board& board) {
+  int calls = 0;
+  mostTransfers = 0;
+  while (board.probeDue()) {
+    calls++;
+    uint32_t before = Wire.transfers;
+    bool back = board.probe();
+    if (Wire.transfers - before > mostTransfers) mostTransfers = Wire.transfers - before;
+    if (back) break;
+    host::advance(1000);
+  }
+  return calls;
+}
+
+void test_begin_configures_device() {
+  Board board("test", bus, firstAddress);
+  TEST_ASSERT_TRUE(board.begin());
+  TEST_ASSERT_EQUAL_HEX8(0xff, device().regs[DirectionA]);
+  TEST_ASSERT_EQUAL_HEX8(0xff, device().regs[DirectionB]);
+  TEST_ASSERT_EQUAL_HEX8(0xff, device().regs[PullupA]);
+  TEST_ASSERT_EQUAL_HEX8(0xff, device().regs[PullupB]);
+  TEST_ASSERT_EQUAL_HEX8(byteMode, device().regs[Config]);
+}
+
+void test_poll_reports_presses() {
+  Board board("test", bus, firstAddress);
+  board.begin();
+  Reading r = board.poll();
+  TEST_ASSERT_TRUE(r.valid);
+  TEST_ASSERT_EQUAL(0, r.edgeCount);
+
+  device().setPins(allUp & ~(1 << 3));
+  host::advance(1000);
+  r = board.poll();
+  TEST_ASSERT_TRUE(r.valid);
+  TEST_ASSERT_EQUAL(1, r.edgeCount);
+  TEST_ASSERT_EQUAL(3, r.edges[0].button);
+  TEST_ASSERT_TRUE(r.edges[0].down);
+}
+
+void test_offline_releases_keys() {
+  Board board("test", bus, firstAddress);
+  board.begin();
+  device().setPins(allUp & ~(1 << 0) & ~(1 << 5));
+  Reading r = board.poll();
+  TEST_ASSERT_EQUAL(2, r.edgeCount);
+
+  device().present = false;
+  for (int i = 1; i < maxErrors; i++) {
+    host::advance(1000);
+    r = board.poll();
+    TEST_ASSERT_FALSE(r.valid);
+    TEST_ASSERT_TRUE(board.ready);
+    TEST_ASSERT_EQUAL(0, r.edgeCount); // keys stay down through a few bad reads
+  }
+  host::advance(1000);
+  r = board.poll();
+  TEST_ASSERT_FALSE(board.ready);
+  TEST_ASSERT_EQUAL(1, board.health.disconnects);
+  TEST_ASSERT_EQUAL(2, r.edgeCount);
+  TEST_ASSERT_EQUAL(0, r.edges[0].button);
+  TEST_ASSERT_FALSE(r.edges[0].down);
+  TEST_ASSERT_EQUAL(5, r.edges[1].button);
+  TEST_ASSERT_FALSE(r.edges[1].down);
+
+  // An offline board isn't read.
+  uint32_t before = Wire.transfers;
+  r = board.poll();
+  TEST_ASSERT_FALSE(r.valid);
+  TEST_ASSERT_EQUAL(0, r.edgeCount);
+  TEST_ASSERT_EQUAL(before, Wire.transfers);
+}
+
+void test_backoff_doubles_up_to_max() {
+  Board board("test", bus, firstAddress);
+  board.begin();
+  device().present = false;
+  pollUntilOffline(board);
+  TEST_ASSERT_FALSE(board.ready);
+
+  unsigned long backoff = minBackoff;
+  for (int attempt = 0; attempt < 12; attempt++) {
+    host::advance(backoff - 1);
+    TEST_ASSERT_FALSE(board.probeDue());
+    host::advance(1);
+    TEST_ASSERT_TRUE(board.probeDue());
+    TEST_ASSERT_FALSE(board.probe());
+    TEST_ASSERT_FALSE(board.probeDue());
+    backoff = backoff * 2 > maxBackoff ? maxBackoff : backoff * 2;
+  }
+  TEST_ASSERT_EQUAL(maxBackoff, backoff);
+  TEST_ASSERT_EQUAL(12, board.health.probes);
+  TEST_ASSERT_EQUAL(0, board.health.reconnects);
+}
+
+void test_reconnects_one_step_per_call() {
+  Board board("test", bus, firstAddress);
+  board.begin();
+  device().present = false;
+  pollUntilOffline(board);
+
+  device() = SimDevice();
+  device().present = true;
+  device().setPins(allUp);
+  host::advance(minBackoff);
+  TEST_ASSERT_EQUAL(Device::setupSteps, probeUntilDone(board));
+  TEST_ASSERT_EQUAL(1, mostTransfers);
+  TEST_ASSERT_TRUE(board.ready);
+  TEST_ASSERT_EQUAL(1, board.health.reconnects);
+  TEST_ASSERT_EQUAL_HEX8(byteMode, device().regs[Config]);
+  TEST_ASSERT_TRUE(board.poll().valid);
+
+  // Going offline again starts over from the shortest backoff.
+  device().present = false;
+  pollUntilOffline(board);
+  host::advance(minBackoff);
+  TEST_ASSERT_TRUE(board.probeDue());
+}
+
+void test_failed_step_starts_over_after_backoff() {
+  Board board("test", bus, firstAddress);
+  board.begin();
+  device().present = false;
+  pollUntilOffline(board);
+
+  device().present = true;
+  host::advance(minBackoff);
+  TEST_ASSERT_FALSE(board.probe()); // ping
+  TEST_ASSERT_TRUE(board.probeDue());
+  Wire.failTransfers = 1;
+  TEST_ASSERT_FALSE(board.probe()); // direction registers
+  TEST_ASSERT_FALSE(board.probeDue());
+
+  host::advance(2 * minBackoff);
+  TEST_ASSERT_EQUAL(Device::setupSteps, probeUntilDone(board));
+  TEST_ASSERT_TRUE(board.ready);
+  TEST_ASSERT_EQUAL(2, board.health.probes);
+}
+
+void test_stuck_bus_fails_fast_and_recovers() {
+  Board board("test", bus, firstAddress);
+  board.begin();
+  host::heldPin = sdaPin;
+  host::releaseAfter = 3;
+
+  for (int i = 0; i < maxErrors; i++) {
+    unsigned long start = micros();
+    uint32_t before = Wire.transfers;
+    TEST_ASSERT_FALSE(board.poll().valid);
+    TEST_ASSERT_EQUAL(before, Wire.transfers); // didn't wait for the timeout
+    TEST_ASSERT_EQUAL(start, micros());
+  }
+  TEST_ASSERT_FALSE(board.ready);
+
+  host::advance(minBackoff);
+  uint32_t before = Wire.transfers;
+  TEST_ASSERT_FALSE(board.probe()); // clears the bus, and nothing else
+  TEST_ASSERT_EQUAL(before, Wire.transfers);
+  TEST_ASSERT_EQUAL(1, bus.recoveries);
+  TEST_ASSERT_FALSE(bus.stuck());
+
+  TEST_ASSERT_EQUAL(Device::setupSteps, probeUntilDone(board));
+  TEST_ASSERT_TRUE(board.ready);
+  TEST_ASSERT_TRUE(board.poll().valid);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_begin_configures_device);
+  RUN_TEST(test_poll_reports_presses);
+  RUN_TEST(test_offline_releases_keys);
+  RUN_TEST(test_backoff_doubles_up_to_max);
+  RUN_TEST(test_reconnects_one_step_per_call);
+  RUN_TEST(test_failed_step_starts_over_after_backoff);
+  RUN_TEST(test_stuck_bus_fails_fast_and_recovers);
+  return UNITY_END();
+}
@@ -0,0 +1,37 @@
+#ifndef BASELINES_H
+#define BASELINES_H
+
+#include "bench.h"
+
+// Baselines for the native benchmarks (test/test_bench): nanoseconds per call, the median
+// of 40 runs in [env:native_bench] on the machine that recorded them.
+//
+// The test scales them to the machine it runs on, by the median of the ratios, so a
+// benchmark fails if it got much slower than the rest. Host timings are noisy, so this
+// only catches large regressions, such as doubling; the budgets in bench_budgets.h are
+// the real limits. After a change that makes something faster, run
+// pio test -e native_bench -v and set its baseline from the times printed.
+
+namespace bench {
+
+const float tolerance = 0.5;
+const uint32_t slack = 3; // nanoseconds, for timer resolution
+
+const Budget baselines[] = {
+  { "countLaps", 13 },
+  { "EllipseFit::add", 6 },
+  { "Weights::addRange", 10 },
+  { "Weights::update", 12 },
+  { "LookupTable::setWeights", 25 },
+  { "LookupTable::adjust", 7 },
+  { "Board::decode", 21 },
+  { "Chord::operator+", 0 },
+  { "Chord::countNotes", 42 },
+  { "Channel::sendChord", 55 },
+};
+
+const int baselineCount = sizeof(baselines) / sizeof(baselines[0]);
+
+} // bench
+
+#endif // BASELINES_H
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <unity.h>
+
+#include "benchmarks.h"
+#include "sensor_benchmarks.h"
+#include "baselines.h"
+
+// The microbenchmarks that build on the host, against the baselines in baselines.h.
+// Prints the results (pio test -e native_bench -v).
+
+// Prints what a Runner prints, and keeps the times from its "PASS name cycles=N" lines.
+class Results : public Print {
+public:
+  static const int maxCount = 32;
+  char names[maxCount][32];
+  uint32_t times[maxCount];
+  int count = 0;
+
+  size_t write(uint8_t c) override {
+    putchar(c);
+    if (c != '\n') {
+      if (length < (int)sizeof(line) - 1) line[length++] = c;
+      return 1;
+    }
+    line[length] = 0;
+    length = 0;
+    if (count < maxCount && sscanf(line, "%*s %31s cycles=%u", names[count], &times[count]) == 2) {
+      count++;
+    }
+    return 1;
+  }
+
+  static const uint32_t missing = UINT32_MAX;
+
+  uint32_t find(const char* name) {
+    for (int i = 0; i < count; i++) {
+      if (strcmp(names[i], name) == 0) return times[i];
+    }
+    return missing;
+  }
+
+private:
+  char line[128];
+  int length = 0;
+};
+
+// Never started, like the device's bench board.
+bassboard::Bus bus(Wire, 4, 5, 400000);
+
+void runAll(bench::Runner& runner) {
+  sensor::runTrackingBenchmarks(runner);
+  bench::runCalibration(runner);
+  bench::runButtons(runner, bus);
+  bench::runOutput(runner);
+}
+
+// How fast this machine is compared with the one the baselines were recorded on, as the
+// median of each benchmark's time over its baseline. Being the median, it doesn't move
+// when a few of them regress.
+float speedOf(Results& results) {
+  float ratios[bench::baselineCount];
+  int count = 0;
+  for (const bench::Budget& b : bench::baselines) {
+    uint32_t t = results.find(b.name);
+    if (t != Results::missing && b.cycles >= bench::slack) ratios[count++] = (float)t / b.cycles;
+  }
+  if (count == 0) return 1;
+  std::nth_element(ratios, ratios + count / 2, ratios + count);
+  return ratios[count / 2];
+}
+
+// Runs the benchmarks and returns how many are slower than their baseline allows: up to
+// tolerance slower, once scaled to this machine, plus slack for the fastest ones, which only
+// take a few nanoseconds. The speed comes from the same run, since the host may be busier
+// from one moment to the next.
+int countRegressions() {
+  static Results results;
+  results.count = 0;
+  bench::Runner runner(results, nullptr, 0);
+  runAll(runner);
+  runner.finish();
+
+  float speed = speedOf(results);
+  printf("speed: %.2f of the baselines' time\n", speed);
+  int regressions = 0;
+  for (const bench::Budget& b : bench::baselines) {
+    uint32_t limit = b.cycles * speed * (1 + bench::tolerance) + bench::slack;
+    uint32_t t = results.find(b.name);
+    if (t == Results::missing) {
+      printf("%s: didn't run\n", b.name);
+      regressions++;
+    } else if (t > limit) {
+      printf("%s: %u ns, over %u ns\n", b.name, t, limit);
+      regressions++;
+    }
+  }
+  return regressions;
+}
+
+void setUp() {}
+void tearDown() {}
+
+// A regression shows up every time, but noise seldom does, so it takes a few runs in a row
+// over the limit to fail.
+void test_within_baselines() {
+  const int attempts = 3;
+  int regressions = 0;
+  for (int i = 0; i < attempts; i++) {
+    regressions = countRegressions();
+    if (regressions == 0) break;
+  }
+  TEST_ASSERT_EQUAL(0, regressions);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_within_baselines);
+  return UNITY_END();
+}
@@ -0,0 +1,187 @@
+#include <Arduino.h>
+#include <stdio.h>
+#include <unity.h>
+
+#include "calibration.h"
+
+// Calibration from synthetic bellows motion, read through a sensor with a known distortion.
+
+using namespace calibration;
+
+// Report lengths of sensor::restRate, normalRate and fastRate, in microseconds.
+const int reportDurations[] = { 6000, 5000, 2000 };
+const int normalReport = 5000;
+
+// Where the sensor says the magnet is, in laps, when it's truly at t.
+double distort(double t) {
+  double f = t - floor(t);
+  return floor(t) + f + 0.04 * sin(2 * M_PI * f) + 0.015 * sin(4 * M_PI * f);
+}
+
+// Puts back the state calibration starts with.
+void resetCalibration(Mode m) {
+  mode = m;
+  weights.fill(1.0 / binCount);
+  lookupTable = LookupTable();
+  lapDirection = none;
+  partial.fill(0);
+  prevPos = nanf("");
+  weightUpdateCount = 0;
+  seenWeightUpdates = 0;
+  nextBin = 0;
+  foundLap = false;
+  dwellAngle.fill(0);
+  dwellCoverage.fill(0);
+  segmentDwell.fill(0);
+  segmentReports = -1;
+  segmentDirection = none;
+  segmentDuration = 0;
+  dwellChanged = false;
+  dwellConfidence = 0;
+}
+
+// The largest difference between the calibrated position and the true one, over a lap.
+float residualError() {
+  float zero = adjustLaps(distort(0));
+  float worst = 0;
+  for (int k = 0; k < 1000; k++) {
+    double t = k / 1000.0;
+    float e = fabs(adjustLaps(distort(t)) - zero - t);
+    if (e > worst) worst = e;
+  }
+  return worst;
+}
+
+struct Result {
+  float timeToCalibrated; // seconds, or -1 if it never was
+  float error;            // laps
+};
+
+// True position in laps at t seconds.
+typedef double (*Motion)(double t);
+
+// Feeds motion for seconds, in reports of duration microseconds.
+Result calibrate(Mode m, Motion motion, int duration, float seconds) {
+  resetCalibration(m);
+  Result r = { -1, 0 };
+  int reports = seconds * 1000000 / duration;
+  for (int i = 0; i < reports; i++) {
+    float raw = distort(motion(i * (double)duration / 1000000));
+    adjustWeights(raw, duration);
+    adjustLaps(raw);
+    if (r.timeToCalibrated < 0 && calibrated()) {
+      r.timeToCalibrated = i * duration / 1000000.0;
+    }
+  }
+  r.error = residualError();
+  return r;
+}
+
+float steadySpeed; // laps per second
+
+double steady(double t) {
+  return steadySpeed * t;
+}
+
+void setUp() {}
+void tearDown() {}
+
+// The adaptive rate changes the report length with speed, so calibration has to learn
+// the same thing, as quickly, at any report length.
+void checkEachRate(Mode m, float speed) {
+  steadySpeed = speed;
+  Result normal = calibrate(m, steady, normalReport, 20);
+  TEST_ASSERT_TRUE(normal.timeToCalibrated >= 0);
+  for (int duration : reportDurations) {
+    Result r = calibrate(m, steady, duration, 20);
+    TEST_ASSERT_TRUE(r.timeToCalibrated >= 0);
+    TEST_ASSERT_TRUE(r.timeToCalibrated < normal.timeToCalibrated * 1.25);
+    TEST_ASSERT_TRUE(fabs(r.error - normal.error) < 0.002);
+  }
+}
+
+// fullLaps ignores reports that move less than half a bin per reference report, about
+// 1.4 laps/s, and the distortion slows the readings down to 0.56 of the true speed.
+void test_full_laps_calibrates_at_each_rate() {
+  checkEachRate(fullLaps, 2);
+  checkEachRate(fullLaps, 3);
+}
+
+void test_dwell_time_calibrates_at_each_rate() {
+  checkEachRate(dwellTime, 0.6);
+  checkEachRate(dwellTime, 1.5);
+  checkEachRate(dwellTime, 2);
+  checkEachRate(dwellTime, 3);
+}
+
+// Comparing the modes, which picked the default (calibration::mode).
+
+const Mode defaultMode = mode;
+
+double triangle(double s) {
+  return (2 / M_PI) * asin(sin(s));
+}
+
+double wholeLaps(double t) { return 2 * t + 0.3 * sin(4 * t); }
+double longStrokes(double t) { return 0.6 * triangle(4 * t); }
+double fastLongStrokes(double t) { return 0.6 * triangle(12 * t); }
+double shortStrokes(double t) { return 0.35 * triangle(4 * t) + 0.004 * t; }
+double smoothLongStrokes(double t) { return 0.6 * sin(4 * t); }
+double smoothShortStrokes(double t) { return 0.35 * sin(4 * t) + 0.004 * t; }
+
+struct Case {
+  const char* name;
+  Motion motion;
+  bool steadyStrokes; // at a steady speed between turning points
+};
+
+const Case cases[] = {
+  { "2 laps/s", steady, true },
+  { "whole laps, varying speed", wholeLaps, true },
+  { "1.2 lap strokes", longStrokes, true },
+  { "fast 1.2 lap strokes", fastLongStrokes, true },
+  { "0.7 lap strokes, drifting", shortStrokes, true },
+  // Slowing down near the same turning points every time looks like distortion to
+  // dwellTime, which ends up worse than uncalibrated. fullLaps never calibrates.
+  { "smooth 1.2 lap strokes", smoothLongStrokes, false },
+  { "smooth 0.7 lap strokes, drifting", smoothShortStrokes, false },
+};
+
+// Time to calibrated() and the error after a minute, in each mode, at normalRate.
+// Prints a table (pio test -e native -v). The default has to calibrate at least as soon
+// and as well wherever the other mode calibrates at all.
+void test_compare_modes() {
+  steadySpeed = 2;
+  Mode other = defaultMode == dwellTime ? fullLaps : dwellTime;
+  printf("uncalibrated error: %.4f laps\n", calibrate(fullLaps, steady, normalReport, 0).error);
+  printf("%-34s %20s %20s\n", "motion", "fullLaps", "dwellTime");
+  for (const Case& c : cases) {
+    Result r[2];
+    r[fullLaps] = calibrate(fullLaps, c.motion, normalReport, 60);
+    r[dwellTime] = calibrate(dwellTime, c.motion, normalReport, 60);
+    printf("%-34s", c.name);
+    for (int m = 0; m < 2; m++) {
+      if (r[m].timeToCalibrated < 0) {
+        printf(" %7s, %.4f laps", "never", r[m].error);
+      } else {
+        printf(" %6.1fs, %.4f laps", r[m].timeToCalibrated, r[m].error);
+      }
+    }
+    printf("\n");
+    if (c.steadyStrokes) {
+      TEST_ASSERT_TRUE(r[defaultMode].timeToCalibrated >= 0);
+    }
+    if (c.steadyStrokes && r[other].timeToCalibrated >= 0) {
+      TEST_ASSERT_TRUE(r[defaultMode].timeToCalibrated <= r[other].timeToCalibrated);
+      TEST_ASSERT_TRUE(r[defaultMode].error <= r[other].error);
+    }
+  }
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_full_laps_calibrates_at_each_rate);
+  RUN_TEST(test_dwell_time_calibrates_at_each_rate);
+  RUN_TEST(test_compare_modes);
+  return UNITY_END();
+}
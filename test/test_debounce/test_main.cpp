@@ -0,0 +1,119 @@
+#include <unity.h>
+
+#include "bassboard.h"
+
+// Key::update with bouncing contacts, polled every pollInterval.
+
+using bassboard::Key;
+using bassboard::defaultDebounce;
+
+const unsigned long pollInterval = 500; // microseconds
+const unsigned long ms = 1000;
+
+// Raw contact state over time: down from pressAt until releaseAt, with the contacts
+// flipping every pollInterval for bounceTime after each change.
+struct Contacts {
+  unsigned long pressAt;
+  unsigned long releaseAt;
+  unsigned long bounceTime;
+
+  bool down(unsigned long t) const {
+    bool state = t - pressAt < releaseAt - pressAt;
+    unsigned long since = state ? t - pressAt : t - releaseAt;
+    if (since < bounceTime && (since / pollInterval) % 2 == 1) {
+      return !state;
+    }
+    return state;
+  }
+};
+
+struct Edges {
+  int presses = 0;
+  int releases = 0;
+  unsigned long pressTime = 0;
+  unsigned long releaseTime = 0;
+  unsigned long releaseReported = 0;
+};
+
+// Polls a key from start for duration, counting the edges it reports.
+Edges run(const Contacts& c, unsigned long start, unsigned long duration) {
+  Key key;
+  Edges e;
+  for (unsigned long t = start; t - start < duration; t += pollInterval) {
+    if (!key.update(c.down(t), t, defaultDebounce)) continue;
+    if (key.down) {
+      e.presses++;
+      e.pressTime = key.changeTime();
+    } else {
+      e.releases++;
+      e.releaseTime = key.changeTime();
+      e.releaseReported = t;
+    }
+  }
+  return e;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_clean_press_and_release() {
+  Edges e = run(Contacts{ 0, 50 * ms, 0 }, 0, 100 * ms);
+  TEST_ASSERT_EQUAL(1, e.presses);
+  TEST_ASSERT_EQUAL(1, e.releases);
+  TEST_ASSERT_EQUAL(0, e.pressTime);
+  TEST_ASSERT_EQUAL(50 * ms, e.releaseTime);
+  TEST_ASSERT_EQUAL(50 * ms + defaultDebounce.releaseDelay, e.releaseReported);
+}
+
+void test_bounce_gives_one_press_and_one_release() {
+  Edges e = run(Contacts{ 0, 50 * ms, 4 * ms }, 0, 100 * ms);
+  TEST_ASSERT_EQUAL(1, e.presses);
+  TEST_ASSERT_EQUAL(1, e.releases);
+  TEST_ASSERT_EQUAL(0, e.pressTime); // presses aren't delayed by bouncing
+  // The release counts from when the contacts last opened.
+  TEST_ASSERT_EQUAL(50 * ms + 4 * ms, e.releaseTime);
+}
+
+void test_bounce_longer_than_lockout() {
+  Edges e = run(Contacts{ 0, 50 * ms, 12 * ms }, 0, 100 * ms);
+  TEST_ASSERT_EQUAL(1, e.presses);
+  TEST_ASSERT_EQUAL(1, e.releases);
+}
+
+void test_tap_shorter_than_lockout() {
+  Edges e = run(Contacts{ 0, 2 * ms, 0 }, 0, 50 * ms);
+  TEST_ASSERT_EQUAL(1, e.presses);
+  TEST_ASSERT_EQUAL(1, e.releases);
+  // The contacts aren't looked at until the lockout is over.
+  TEST_ASSERT_EQUAL(defaultDebounce.pressLockout, e.releaseTime);
+}
+
+void test_blip_while_held_is_ignored() {
+  Key key;
+  unsigned long t = 0;
+  TEST_ASSERT_TRUE(key.update(true, t, defaultDebounce));
+  for (t = pollInterval; t < 40 * ms; t += pollInterval) {
+    bool blip = t >= 20 * ms && t < 20 * ms + defaultDebounce.releaseDelay - pollInterval;
+    TEST_ASSERT_FALSE(key.update(!blip, t, defaultDebounce));
+  }
+  TEST_ASSERT_TRUE(key.down);
+}
+
+void test_micros_wraparound() {
+  unsigned long start = (unsigned long)-3 * ms;
+  Edges e = run(Contacts{ start, start + 50 * ms, 4 * ms }, start, 100 * ms);
+  TEST_ASSERT_EQUAL(1, e.presses);
+  TEST_ASSERT_EQUAL(1, e.releases);
+  TEST_ASSERT_EQUAL(start + 54 * ms, e.releaseTime);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_clean_press_and_release);
+  RUN_TEST(test_bounce_gives_one_press_and_one_release);
+  RUN_TEST(test_bounce_longer_than_lockout);
+  RUN_TEST(test_tap_shorter_than_lockout);
+  RUN_TEST(test_blip_while_held_is_ignored);
+  RUN_TEST(test_micros_wraparound);
+  return UNITY_END();
+}
@@ -0,0 +1,128 @@
+#include <unity.h>
+
+#include "laps.h"
+
+// countLaps on simulated bellows motion, sampled every samplePeriod.
+
+using namespace sensor;
+
+const int samplePeriod = 20000; // microseconds, slower than any real rate
+
+LapCounter lc;
+Report rep;
+double position; // true position in ticks
+unsigned long sampleTime;
+
+// Takes a sample at the true position, offset by glitch ticks.
+void sample(int glitch = 0) {
+  long p = (long)floor(position) + glitch;
+  rep.clear();
+  rep.last.sampleTime = sampleTime;
+  rep.last.theta = ((p % ticksPerTurn) + ticksPerTurn) % ticksPerTurn;
+  countLaps(lc, rep);
+}
+
+long trueLaps() {
+  return (long)floor(floor(position) / ticksPerTurn);
+}
+
+// Moves at speed (ticks per second) for one sample period, then samples.
+void move(double speed, int glitch = 0) {
+  position += speed * samplePeriod / 1000000;
+  sampleTime += samplePeriod;
+  sample(glitch);
+}
+
+void setUp() {
+  lc = LapCounter();
+  position = 0;
+  sampleTime = 1000;
+  lc.prevTime = sampleTime;
+}
+
+void tearDown() {}
+
+// Starts from rest at speed and keeps going, returning how many samples had the wrong lap
+// count after the first few.
+int runSteady(double speed, int samples, int settle) {
+  int wrong = 0;
+  for (int i = 0; i < samples; i++) {
+    move(speed);
+    if (i >= settle && lc.laps != trueLaps()) wrong++;
+  }
+  return wrong;
+}
+
+void test_steady_from_rest_below_limit() {
+  double limit = maxSafeSpeed(samplePeriod);
+  TEST_ASSERT_EQUAL(quarterTurn * 1000000 / samplePeriod, limit);
+  for (double speed : { 0.5 * limit, 0.9 * limit, limit, -limit }) {
+    setUp();
+    TEST_ASSERT_EQUAL(0, runSteady(speed, 300, 0));
+    TEST_ASSERT_EQUAL(0, lc.jumps);
+  }
+}
+
+// Faster than the limit from rest, the first samples are jumps, but they follow on from
+// each other, so the counter picks up the speed and the laps crossed meanwhile.
+void test_steady_from_rest_above_limit() {
+  double limit = maxSafeSpeed(samplePeriod);
+  for (double speed : { 9500.0, 12000.0, 1.2 * limit, 1.5 * limit, 1.9 * limit, -1.5 * limit }) {
+    setUp();
+    TEST_ASSERT_EQUAL(0, runSteady(speed, 300, jumpsToResync));
+    TEST_ASSERT_EQUAL(jumpsToResync, lc.jumps);
+    TEST_ASSERT_TRUE(fabs(rep.speed - speed) < fabs(speed) / 100);
+  }
+}
+
+// Speeding up steadily from rest to well past the limit, by much less than the limit
+// each sample.
+void test_speeding_up_from_rest() {
+  double limit = maxSafeSpeed(samplePeriod);
+  double speed = 0;
+  for (int i = 0; i < 400; i++) {
+    speed += limit / 100;
+    move(speed);
+    TEST_ASSERT_EQUAL(trueLaps(), lc.laps);
+  }
+  TEST_ASSERT_EQUAL(0, lc.jumps);
+}
+
+// A glitch now and then is counted, but doesn't move the lap count or the velocity.
+void test_glitches_are_ignored() {
+  double speed = 3 * ticksPerTurn; // 3 turns a second, 43 ticks per sample
+  for (int i = 0; i < 20; i++) move(speed);
+  int glitches = 0;
+  for (int i = 0; i < 2000; i++) {
+    bool glitch = i % 97 == 50;
+    int velocityBefore = lc.velocity;
+    move(speed, glitch ? 300 : 0);
+    if (glitch) {
+      glitches++;
+      TEST_ASSERT_EQUAL(velocityBefore, lc.velocity);
+    } else {
+      TEST_ASSERT_EQUAL(trueLaps(), lc.laps);
+    }
+  }
+  TEST_ASSERT_EQUAL(glitches, lc.jumps);
+}
+
+// A lasting shift isn't a glitch. Tracking carries on from it after a few samples.
+void test_lasting_shift_resyncs() {
+  double speed = ticksPerTurn;
+  for (int i = 0; i < 20; i++) move(speed);
+  position += 300;
+  for (int i = 0; i < 200; i++) move(speed);
+  TEST_ASSERT_TRUE(lc.jumps <= 2 * jumpsToResync);
+  TEST_ASSERT_EQUAL(trueLaps(), lc.laps);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_steady_from_rest_below_limit);
+  RUN_TEST(test_steady_from_rest_above_limit);
+  RUN_TEST(test_speeding_up_from_rest);
+  RUN_TEST(test_glitches_are_ignored);
+  RUN_TEST(test_lasting_shift_resyncs);
+  return UNITY_END();
+}
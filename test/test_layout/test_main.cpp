@@ -0,0 +1,244 @@
+#include <unity.h>
+
+#include "layout.h"
+
+// Swapping layouts while the boards are scanned every frame, as loop() does: SysEx edits
+// and program changes arrive between scans, and a committed layout is only taken up at
+// the start of a frame.
+
+using music::Chord;
+using music::Note;
+
+const int sdaPin = 4;
+const int sclPin = 5;
+const int boardCount = 2;
+const uint16_t allUp = 0xffff;
+const unsigned long frameTime = 1000; // microseconds
+
+bassboard::Bus bus(Wire, sdaPin, sclPin, 400000);
+bassboard::Board* boards[boardCount];
+
+// Key k plays note first + k.
+bassboard::KeyMap ascending(Note first) {
+  bassboard::KeyMap m;
+  for (int k = 0; k < bassboard::buttonCount; k++) {
+    m.toNote[k] = Chord(first + k);
+  }
+  return m;
+}
+
+const Note oldFirst = music::C2;
+const Note newFirst = music::C3;
+
+// What a set of held keys plays with the map starting at first.
+Chord expected(uint16_t held, Note first) {
+  Chord c;
+  for (int k = 0; k < bassboard::buttonCount; k++) {
+    if (held & (1 << k)) c = c + Chord(first + k);
+  }
+  return c;
+}
+
+void applyLayout() {
+  for (int b = 0; b < boardCount; b++) {
+    boards[b]->setRoutes(&layout::active->routes[b]);
+  }
+}
+
+uint32_t frames;
+uint32_t swapFrame; // first frame that used the new layout
+bool committed;     // the last swap was a SysEx commit, so it would be acked
+
+// Runs a frame: takes any committed layout, then scans both boards. Returns the chords
+// played on the chord output, by board.
+void runFrame(Chord played[boardCount]) {
+  host::advance(frameTime);
+  if (layout::takeSwap(committed)) {
+    applyLayout();
+    swapFrame = frames;
+  }
+  for (int b = 0; b < boardCount; b++) {
+    bassboard::Reading r = boards[b]->poll();
+    TEST_ASSERT_TRUE(r.valid); // scanning never stops for an edit
+    played[b] = r.notes[layout::chord];
+  }
+  frames++;
+}
+
+// Builds a SysEx message setting one key of a layer.
+void setKeyMessage(byte* msg, int board, int layer, int key, Chord c) {
+  uint64_t bits = c.toBits();
+  msg[0] = 0xF0;
+  msg[1] = layout::manufacturerId;
+  msg[2] = layout::SetKey;
+  msg[3] = board;
+  msg[4] = layer;
+  msg[5] = key;
+  for (int i = 0; i < 10; i++) {
+    msg[6 + i] = (bits >> (7 * i)) & 0x7f;
+  }
+  msg[16] = 0xF7;
+}
+
+void sendCommit() {
+  byte commit[] = { 0xF0, layout::manufacturerId, layout::Commit, 0xF7 };
+  layout::handleSysEx(commit, sizeof(commit));
+}
+
+void setUp() {
+  host::time = 0;
+  host::heldPin = -1;
+  Wire = TwoWire();
+  bus.begin(1);
+  for (int b = 0; b < boardCount; b++) {
+    Wire.devices[b].present = true;
+    Wire.devices[b].setPins(allUp);
+    boards[b] = new bassboard::Board("test", bus, bassboard::firstAddress + b);
+    boards[b]->begin();
+  }
+
+  layout::buffers[0] = layout::Layout();
+  layout::buffers[1] = layout::Layout();
+  layout::active = &layout::buffers[0];
+  layout::back = &layout::buffers[1];
+  layout::Layout* l = layout::active;
+  for (int b = 0; b < boardCount; b++) {
+    l->layers[b] = layout::Layer{ (uint8_t)b, layout::chord, 100, ascending(oldFirst) };
+  }
+  l->layerCount = boardCount;
+  l->bottomBass = music::C2.toMidiNumber();
+  for (int out = 0; out < layout::outputCount; out++) {
+    l->channel[out] = out + 1;
+    layout::setDefaultVelocities(*l, (layout::Output)out);
+  }
+  layout::begin(boardCount);
+  layout::accepted = 0;
+  layout::rejected = 0;
+  layout::swaps = 0;
+  applyLayout();
+  frames = 0;
+  swapFrame = 0;
+}
+
+void tearDown() {
+  for (int b = 0; b < boardCount; b++) {
+    delete boards[b];
+  }
+}
+
+// Every scan plays the whole old map or the whole new map, never a mix, and the new
+// map is used from the frame after the commit.
+void test_sysex_swap_under_scanning() {
+  const uint16_t held = (1 << 2) | (1 << 5) | (1 << 9) | (1 << 15);
+  for (int b = 0; b < boardCount; b++) {
+    Wire.devices[b].setPins(allUp & ~held);
+  }
+  Chord played[boardCount];
+  runFrame(played);
+
+  // One key per frame, for every key on both boards, then the commit.
+  uint32_t commitFrame = 0;
+  for (int b = 0; b < boardCount; b++) {
+    for (int k = 0; k < bassboard::buttonCount; k++) {
+      byte msg[17];
+      setKeyMessage(msg, b, 0, k, Chord(newFirst + k));
+      layout::handleSysEx(msg, sizeof(msg));
+      runFrame(played);
+      for (int p = 0; p < boardCount; p++) {
+        TEST_ASSERT_TRUE(played[p] == expected(held, oldFirst));
+      }
+    }
+  }
+  TEST_ASSERT_EQUAL(2 * bassboard::buttonCount, layout::accepted);
+  sendCommit();
+  commitFrame = frames;
+
+  // Edits are refused until the swap is done.
+  byte late[17];
+  setKeyMessage(late, 0, 0, 0, Chord(oldFirst));
+  layout::handleSysEx(late, sizeof(late));
+  TEST_ASSERT_EQUAL(1, layout::rejected);
+
+  for (int f = 0; f < 20; f++) {
+    runFrame(played);
+    for (int p = 0; p < boardCount; p++) {
+      TEST_ASSERT_TRUE(played[p] == expected(held, newFirst));
+    }
+  }
+  TEST_ASSERT_EQUAL(commitFrame, swapFrame);
+  TEST_ASSERT_EQUAL(1, layout::swaps);
+  TEST_ASSERT_TRUE(committed);
+}
+
+// Program changes swap whole presets back and forth while keys are pressed and released.
+void test_preset_swaps_under_scanning() {
+  layout::Layer oldLayers[boardCount];
+  layout::Layer newLayers[boardCount];
+  for (int b = 0; b < boardCount; b++) {
+    oldLayers[b] = layout::Layer{ (uint8_t)b, layout::chord, 100, ascending(oldFirst) };
+    newLayers[b] = layout::Layer{ (uint8_t)b, layout::chord, 100, ascending(newFirst) };
+  }
+
+  bool usingNew = false;
+  Chord played[boardCount];
+  uint32_t loads = 0;
+  for (int f = 0; f < 2000; f++) {
+    // A different chord on each board most frames, held a few frames at a time.
+    uint16_t held[boardCount];
+    for (int b = 0; b < boardCount; b++) {
+      held[b] = ((f / 30 + 1) * 2654435761u >> (b * 7) & 0x7fff) | 1;
+      Wire.devices[b].setPins(allUp & ~held[b]);
+    }
+    if (f % 7 == 3) {
+      // Several in one frame, as when a host sends program changes on loading a project.
+      // The last one wins.
+      bool toNew = (f / 7) % 2 == 0;
+      TEST_ASSERT_TRUE(layout::loadLayers(toNew ? oldLayers : newLayers, boardCount));
+      TEST_ASSERT_TRUE(layout::loadLayers(toNew ? newLayers : oldLayers, boardCount));
+      loads++;
+    }
+    uint32_t swapsBefore = layout::swaps;
+    runFrame(played);
+    if (layout::swaps != swapsBefore) {
+      usingNew = !usingNew;
+      TEST_ASSERT_FALSE(committed); // presets aren't acked
+    }
+    for (int b = 0; b < boardCount; b++) {
+      // Debouncing can hold a released key for a few frames, so check that whatever is
+      // played all comes from the active map.
+      Chord all = expected(allUp, usingNew ? newFirst : oldFirst);
+      TEST_ASSERT_TRUE(played[b] + all == all);
+    }
+  }
+  TEST_ASSERT_EQUAL(loads, layout::swaps);
+}
+
+// Presets wait for a SysEx edit and its commit, rather than replacing them.
+void test_preset_waits_for_sysex() {
+  layout::Layer newLayers[boardCount];
+  for (int b = 0; b < boardCount; b++) {
+    newLayers[b] = layout::Layer{ (uint8_t)b, layout::chord, 100, ascending(newFirst) };
+  }
+  byte msg[17];
+  setKeyMessage(msg, 0, 0, 0, Chord(newFirst));
+  layout::handleSysEx(msg, sizeof(msg));
+  TEST_ASSERT_FALSE(layout::loadLayers(newLayers, boardCount));
+  sendCommit();
+  TEST_ASSERT_FALSE(layout::loadLayers(newLayers, boardCount));
+
+  Chord played[boardCount];
+  runFrame(played);
+  TEST_ASSERT_TRUE(committed);
+  TEST_ASSERT_TRUE(layout::loadLayers(newLayers, boardCount));
+  runFrame(played);
+  TEST_ASSERT_FALSE(committed);
+  TEST_ASSERT_EQUAL(2, layout::swaps);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_sysex_swap_under_scanning);
+  RUN_TEST(test_preset_swaps_under_scanning);
+  RUN_TEST(test_preset_waits_for_sysex);
+  return UNITY_END();
+}
@@ -0,0 +1,190 @@
+#include <unity.h>
+
+#include "midi_in.h"
+
+// midiIn::read through a MIDI interface on a simulated transport, with the host sending
+// faster than a frame's read budget can keep up with.
+
+const unsigned long frameTime = 1000; // microseconds
+const unsigned long byteTime = 1;     // microseconds to read and parse one byte
+const int ccBytes = 3;
+
+// Bytes from the host, waiting to be read. Reading one takes byteTime.
+class SimTransport {
+public:
+  static const bool thruActivated = false;
+
+  void begin() {}
+  bool beginTransmission(midi::MidiType) { return true; }
+  void write(byte) {}
+  void endTransmission() {}
+
+  byte read() {
+    host::advance(byteTime);
+    return queue[head++ % capacity];
+  }
+
+  unsigned available() {
+    return tail - head;
+  }
+
+  void send(byte b) {
+    queue[tail++ % capacity] = b;
+  }
+
+  void clear() {
+    head = tail = 0;
+  }
+
+private:
+  static const uint32_t capacity = 1 << 16;
+  byte queue[capacity];
+  uint32_t head = 0;
+  uint32_t tail = 0;
+};
+
+SimTransport port;
+midi::MidiInterface<SimTransport, midiIn::Settings> in(port);
+
+// Control change values, in the order they were handled.
+uint32_t ccCount;
+uint32_t ccOutOfOrder;
+uint8_t lastValue;
+
+void handleControlChange(midi::Channel, midi::DataByte, midi::DataByte value) {
+  if (ccCount > 0 && value != (uint8_t)((lastValue + 1) & 0x7f)) ccOutOfOrder++;
+  lastValue = value;
+  ccCount++;
+}
+
+uint32_t ccSent;
+
+void sendControlChange() {
+  port.send(0xB0);
+  port.send(7);
+  port.send(ccSent++ & 0x7f);
+}
+
+void sendClock() {
+  port.send(0xF8);
+}
+
+// Runs one frame's read, returning how long it took.
+unsigned long readFrame() {
+  unsigned long start = micros();
+  midiIn::read(in);
+  unsigned long elapsed = micros() - start;
+  host::advance(frameTime - elapsed);
+  return elapsed;
+}
+
+void setUp() {
+  host::time = 0;
+  port.clear();
+  in.begin(MIDI_CHANNEL_OMNI);
+  midiIn::begin(in);
+  in.setHandleControlChange(handleControlChange);
+  midiIn::stats = {};
+  midiIn::clock = {};
+  ccCount = 0;
+  ccOutOfOrder = 0;
+  ccSent = 0;
+}
+
+void tearDown() {}
+
+void test_drains_input_within_budget() {
+  const int count = 40; // 120 us of reading
+  for (int i = 0; i < count; i++) sendControlChange();
+  readFrame();
+  TEST_ASSERT_EQUAL(count, midiIn::stats.received);
+  TEST_ASSERT_EQUAL(count, ccCount);
+  TEST_ASSERT_EQUAL(0, midiIn::stats.budgetHits);
+  TEST_ASSERT_EQUAL(0, port.available());
+}
+
+void test_partial_message_finishes_next_frame() {
+  port.send(0xB0);
+  port.send(7);
+  readFrame();
+  TEST_ASSERT_EQUAL(0, midiIn::stats.received);
+  port.send(42);
+  readFrame();
+  TEST_ASSERT_EQUAL(1, ccCount);
+  TEST_ASSERT_EQUAL(42, lastValue);
+}
+
+// A burst far bigger than one frame's budget is read over several frames, each stopping
+// at the budget, without losing or reordering anything.
+void test_burst_is_spread_over_frames() {
+  const int count = 3000;
+  for (int i = 0; i < count; i++) sendControlChange();
+  int frames = 0;
+  while (port.available() > 0 && frames < 1000) {
+    unsigned long elapsed = readFrame();
+    TEST_ASSERT_LESS_OR_EQUAL(midiIn::readBudget + ccBytes * byteTime, elapsed);
+    frames++;
+  }
+  TEST_ASSERT_EQUAL(count, ccCount);
+  TEST_ASSERT_EQUAL(0, ccOutOfOrder);
+  TEST_ASSERT_EQUAL(frames - 1, midiIn::stats.budgetHits);
+  // Each frame should read about as much as its budget allows.
+  int perFrame = midiIn::readBudget / (ccBytes * byteTime);
+  TEST_ASSERT_LESS_OR_EQUAL(count / perFrame + 2, frames);
+}
+
+// At a steady rate above what the budget reads, every frame stops at the budget and the
+// backlog grows, but it all arrives once the host slows down. Clock ticks among the
+// control changes are all counted.
+void test_sustained_flood_with_clock() {
+  const int framesSending = 500;
+  const int ccPerFrame = 100; // 300 us of reading per frame
+  int ticks = 0;
+  for (int f = 0; f < framesSending; f++) {
+    for (int i = 0; i < ccPerFrame; i++) {
+      sendControlChange();
+      if (i == ccPerFrame / 2 && f % 20 == 0) {
+        sendClock();
+        ticks++;
+      }
+    }
+    unsigned long elapsed = readFrame();
+    TEST_ASSERT_LESS_OR_EQUAL(midiIn::readBudget + ccBytes * byteTime, elapsed);
+  }
+  TEST_ASSERT_EQUAL(framesSending, midiIn::stats.budgetHits);
+  TEST_ASSERT_GREATER_THAN(0, port.available());
+
+  int frames = 0;
+  while (port.available() > 0 && frames < 10000) {
+    readFrame();
+    frames++;
+  }
+  TEST_ASSERT_EQUAL(ccSent, ccCount);
+  TEST_ASSERT_EQUAL(0, ccOutOfOrder);
+  TEST_ASSERT_EQUAL(ticks, midiIn::clock.ticks);
+  TEST_ASSERT_EQUAL(ccSent + ticks, midiIn::stats.received);
+  TEST_ASSERT_LESS_OR_EQUAL(midiIn::readBudget + ccBytes * byteTime, midiIn::stats.maxReadTime);
+}
+
+// Below the budget, the input is empty after every frame.
+void test_sustained_rate_under_budget_keeps_up() {
+  const int ccPerFrame = 60; // 180 us of reading per frame
+  for (int f = 0; f < 1000; f++) {
+    for (int i = 0; i < ccPerFrame; i++) sendControlChange();
+    readFrame();
+    TEST_ASSERT_EQUAL(0, port.available());
+  }
+  TEST_ASSERT_EQUAL(0, midiIn::stats.budgetHits);
+  TEST_ASSERT_EQUAL(ccPerFrame, midiIn::stats.maxReads);
+  TEST_ASSERT_EQUAL(ccSent, ccCount);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_drains_input_within_budget);
+  RUN_TEST(test_partial_message_finishes_next_frame);
+  RUN_TEST(test_burst_is_spread_over_frames);
+  RUN_TEST(test_sustained_flood_with_clock);
+  RUN_TEST(test_sustained_rate_under_budget_keeps_up);
+  return UNITY_END();
+}
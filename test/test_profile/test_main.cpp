@@ -0,0 +1,48 @@
+#include <unity.h>
+#include <string>
+
+#include "profile.h"
+
+// profile.cpp's host build, which test_build_src adds to the native environment.
+
+class StringPrint : public Print {
+public:
+  std::string text;
+  size_t write(uint8_t c) override {
+    text += (char)c;
+    return 1;
+  }
+};
+
+void setUp() {
+  profile::clear();
+}
+
+void tearDown() {}
+
+void test_records_count_max_and_total() {
+  profile::record(profile::CountLaps, 10);
+  profile::record(profile::CountLaps, 30);
+  profile::Stats s = profile::stats[0][profile::CountLaps];
+  TEST_ASSERT_EQUAL(2, s.count);
+  TEST_ASSERT_EQUAL(30, s.max);
+  TEST_ASSERT_EQUAL(40, s.total);
+}
+
+// Totals pass 32 bits after about 30 seconds of cycles, and have to print in full.
+void test_prints_64_bit_total() {
+  for (int i = 0; i < 5; i++) {
+    profile::record(profile::PollBoards, 1000000000);
+  }
+  StringPrint out;
+  profile::printTo(out);
+  TEST_ASSERT_TRUE(out.text.find("pollBoards: count=5 avg=1000000000 max=1000000000 total=5000000000") !=
+    std::string::npos);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_records_count_max_and_total);
+  RUN_TEST(test_prints_64_bit_total);
+  return UNITY_END();
+}
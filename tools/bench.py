@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+"""Runs the benchmarks on the device and fails if any of them regressed.
+
+    tools/bench.py /dev/ttyACM0            # run and check
+    tools/bench.py /dev/ttyACM0 --update   # also record this run as the baseline
+    tools/bench.py --log bench.txt         # check output saved from an earlier run
+
+Sends 'x' over serial and reads until the "bench: count=N failures=N" summary line.
+Exits with status 1 if a benchmark is over its budget (include/bench_budgets.h) or
+more than --tolerance slower than its baseline, and 2 if no summary line arrives.
+
+Baselines are kept in tools/bench_baselines.txt, one "name cycles" line each. They
+can only be measured on a device, so run with --update on one to record them, and
+again after a change that makes something faster.
+
+Without a device, pio test -e native_bench runs the benchmarks that build on the host
+against the baselines in test/test_bench/baselines.h.
+"""
+
+import argparse
+import os
+import re
+import sys
+import time
+
+RESULT = re.compile(r"^(PASS|FAIL) (\S+) cycles=(\d+)")
+SUMMARY = re.compile(r"^bench: count=(\d+) failures=(\d+)")
+BASELINES = os.path.join(os.path.dirname(os.path.abspath(__file__)), "bench_baselines.txt")
+
+
+def read_device(port, timeout):
+    import serial  # pyserial, which comes with PlatformIO
+
+    with serial.Serial(port, 115200, timeout=1) as s:
+        s.reset_input_buffer()
+        s.write(b"x")
+        deadline = time.time() + timeout
+        while time.time() < deadline:
+            line = s.readline().decode("ascii", "replace").strip()
+            if line:
+                yield line
+            if SUMMARY.match(line):
+                return
+
+
+def read_log(path):
+    with open(path) as f:
+        for line in f:
+            yield line.strip()
+
+
+def load_baselines(path):
+    baselines = {}
+    if os.path.exists(path):
+        with open(path) as f:
+            for line in f:
+                parts = line.split()
+                if len(parts) == 2 and not line.startswith("#"):
+                    baselines[parts[0]] = int(parts[1])
+    return baselines
+
+
+def save_baselines(path, results):
+    with open(path, "w") as f:
+        f.write("# Cycles per call, from tools/bench.py --update on a device.\n")
+        for name, cycles in results.items():
+            f.write("%s %d\n" % (name, cycles))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("port", nargs="?", help="serial port of the device")
+    parser.add_argument("--log", help="check saved output instead of running on a device")
+    parser.add_argument("--update", action="store_true", help="record this run as the baseline")
+    parser.add_argument("--tolerance", type=float, default=0.1,
+                        help="fraction slower than the baseline that counts as a regression")
+    parser.add_argument("--timeout", type=float, default=30, help="seconds to wait for the summary")
+    args = parser.parse_args()
+    if not args.port and not args.log:
+        parser.error("give a serial port or --log")
+
+    lines = read_log(args.log) if args.log else read_device(args.port, args.timeout)
+    baselines = load_baselines(BASELINES)
+    results = {}
+    summary = None
+    regressions = 0
+    for line in lines:
+        m = RESULT.match(line)
+        if m:
+            print(line)
+            name, cycles = m.group(2), int(m.group(3))
+            results[name] = cycles
+            base = baselines.get(name)
+            if base and cycles > base * (1 + args.tolerance):
+                print("  slower than baseline: %d cycles, was %d" % (cycles, base))
+                regressions += 1
+        m = SUMMARY.match(line)
+        if m:
+            print(line)
+            summary = int(m.group(1)), int(m.group(2))
+            break
+
+    if summary is None:
+        print("no summary line; the run didn't finish")
+        sys.exit(2)
+    if not baselines:
+        print("no baselines yet; run with --update on a device to record them")
+    if args.update:
+        save_baselines(BASELINES, results)
+    failures = summary[1] + regressions
+    print("%d benchmarks, %d over budget, %d slower than baseline" % (summary[0], summary[1], regressions))
+    sys.exit(1 if failures else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,136 @@
+#!/usr/bin/env python3
+"""Encodes a layout file as SysEx messages for the controller.
+
+The layout file is JSON, for example:
+
+    {
+      "boards": [
+        {
+          "chord": [[], [], [], [], [], [], [], [],
+                    ["E2"], ["A2"], ["D2"], ["G2"], ["C2"], ["F2"], ["Bb2"], ["Eb2"]],
+          "bass": [["G2"], ["D3"], ...]
+        },
+        ...
+      ],
+      "bottomBass": "G2",
+      "channels": {"treble": 1, "chord": 2, "bass": 3},
+      "velocity": {"chord": 99}
+    }
+
+Each board has 16 entries per layer, one per button, listing the notes it plays.
+Everything is optional; anything left out stays as it is on the device.
+
+Instead of "chord" and "bass", a board can list any number of layers, each playing on
+one output with a velocity percent. This replaces all of the board's layers:
+
+    {"layers": [
+      {"output": "chord", "keys": [...]},
+      {"output": "treble", "velocity": 60, "keys": [...]}
+    ]}
+A velocity can be a single number for all notes, or a list of 64 starting at C1.
+
+The output is a .syx file ending with a commit message. Send it with any SysEx tool
+(for example, amidi -s layout.syx) and wait for the device to reply F0 7D 7F F7.
+See include/layout.h for the message format.
+"""
+
+import argparse
+import json
+import re
+
+MANUFACTURER_ID = 0x7D
+SET_KEY, SET_BOTTOM_BASS, SET_VELOCITY, SET_CHANNEL = 0x01, 0x02, 0x03, 0x04
+SET_LAYER, SET_LAYER_COUNT, COMMIT = 0x05, 0x06, 0x7F
+
+CHORD_BASE = 24  # C1, as in music.h
+NOTE_COUNT = 64
+BUTTON_COUNT = 16
+OUTPUTS = {"treble": 0, "chord": 1, "bass": 2}
+
+NOTE_NAMES = {"C": 0, "D": 2, "E": 4, "F": 5, "G": 7, "A": 9, "B": 11}
+
+
+def note_number(name):
+    """Converts a name like "Bb2" or "F#3" to a MIDI note number (C4 = 60)."""
+    m = re.fullmatch(r"([A-G])([#b]?)(-?\d+)", name)
+    if not m:
+        raise ValueError("bad note name: %s" % name)
+    letter, accidental, octave = m.groups()
+    num = NOTE_NAMES[letter] + 12 * (int(octave) + 1)
+    num += {"#": 1, "b": -1, "": 0}[accidental]
+    if not CHORD_BASE <= num < CHORD_BASE + NOTE_COUNT:
+        raise ValueError("note out of range: %s" % name)
+    return num
+
+
+def sysex(command, *data):
+    for b in data:
+        if not 0 <= b <= 0x7F:
+            raise ValueError("data byte out of range: %d" % b)
+    return bytes([0xF0, MANUFACTURER_ID, command, *data, 0xF7])
+
+
+def encode_chord(notes):
+    bits = 0
+    for name in notes:
+        bits |= 1 << (note_number(name) - CHORD_BASE)
+    return [(bits >> (7 * i)) & 0x7F for i in range(10)]
+
+
+def encode_keys(board, layer, keys):
+    if len(keys) != BUTTON_COUNT:
+        raise ValueError("board %d layer %d: expected %d buttons" % (board, layer, BUTTON_COUNT))
+    return [sysex(SET_KEY, board, layer, button, *encode_chord(notes))
+            for button, notes in enumerate(keys)]
+
+
+def encode(layout):
+    messages = []
+    for board, maps in enumerate(layout.get("boards", [])):
+        if "layers" in maps:
+            layers = maps["layers"]
+            for layer, spec in enumerate(layers):
+                velocity = spec.get("velocity", 100)
+                if not 1 <= velocity <= 127:
+                    raise ValueError("board %d layer %d: velocity out of range" % (board, layer))
+                messages.append(sysex(SET_LAYER, board, layer, OUTPUTS[spec["output"]], velocity))
+                messages += encode_keys(board, layer, spec.get("keys", [[]] * BUTTON_COUNT))
+            messages.append(sysex(SET_LAYER_COUNT, board, len(layers)))
+            continue
+        for layer, key in ((0, "chord"), (1, "bass")):
+            if key in maps:
+                messages += encode_keys(board, layer, maps[key])
+
+    if "bottomBass" in layout:
+        messages.append(sysex(SET_BOTTOM_BASS, note_number(layout["bottomBass"])))
+
+    for output, values in layout.get("velocity", {}).items():
+        if isinstance(values, int):
+            values = [values] * NOTE_COUNT
+        if len(values) != NOTE_COUNT or not all(1 <= v <= 127 for v in values):
+            raise ValueError("%s velocity: expected %d values from 1 to 127" % (output, NOTE_COUNT))
+        messages.append(sysex(SET_VELOCITY, OUTPUTS[output], 0, *values))
+
+    for output, channel in layout.get("channels", {}).items():
+        if not 1 <= channel <= 16:
+            raise ValueError("%s channel out of range: %d" % (output, channel))
+        messages.append(sysex(SET_CHANNEL, OUTPUTS[output], channel))
+
+    messages.append(sysex(COMMIT))
+    return b"".join(messages)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("layout", help="layout file (JSON)")
+    parser.add_argument("output", help="SysEx file to write")
+    args = parser.parse_args()
+
+    with open(args.layout) as f:
+        layout = json.load(f)
+    with open(args.output, "wb") as f:
+        f.write(encode(layout))
+
+
+if __name__ == "__main__":
+    main()